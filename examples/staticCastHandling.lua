@@ -34,13 +34,14 @@ walk(path,
     local r = read(file.path);
     if(file.path == "") then return end
     local tree = java:parse(file.path, true)
+    if not tree then return end -- timed out, left for the summary
     local w = write(file.path)
     local edt = Editor()
 
     tree:query(findNativeQuery,
       function(c)
-        if c.second_arg.text ~= "Object[].class" then return end
-        tree:query(findCasts,
+        local row = c.second_arg.row
+        tree:queryIn({ row = row + 1, endRow = row + 201 }, findCasts,
         function(match)
           if match.cast.row <= c.second_arg.row then return end
           if match.cast.row > c.second_arg.row + 200 then return end
@@ -12,7 +12,6 @@ using namespace std;
 string q_createNativeQuery = R"(
 (method_invocation
   (identifier) @method_name
-  ; eq dont work for some reason
   (#eq? @method_name "createNativeQuery")
   arguments: (argument_list
     ([
@@ -28,7 +27,6 @@ string q_createNativeQuery = R"(
 string q_tupleTransformer = R"(
 (method_invocation
     (identifier) @method_name
-    ; eq dont work for some reason
     (#eq? @method_name "setTupleTransformer")
  arguments: 
    (argument_list
@@ -15,6 +15,12 @@
 
 #include <condition_variable>
 #include <atomic>
+#include <shared_mutex>
+#include <unordered_map>
+#include <memory>
+#include <vector>
+#include <deque>
+#include <algorithm>
 
 namespace copypasta {
 
@@ -60,31 +66,358 @@ public:
   }
 };
 
+// Counters of a ShardedCache
+struct CacheStats {
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  uint64_t evictions = 0;
+  size_t entries = 0;
+  size_t bytes = 0;
+  size_t budget = 0;
+};
+
+// Tells the caches below when a retired value can be freed.
+// A thread is online from its first lookup until it calls offline() at a
+// point where it holds no pointer from any cache, pool workers do after every
+// job and Lua walks after every file. A value retired in epoch e is freed once
+// every online thread came online after e.
+class CacheEpoch {
+  struct Record {
+    std::atomic<uint64_t> online{0}; // epoch it came online in, 0 when offline
+  };
+  struct Holder {
+    std::shared_ptr<Record> record;
+    Holder();
+    ~Holder() { record->online.store(0); }
+  };
+  static std::atomic<uint64_t> current;
+  static std::vector<std::shared_ptr<Record>> &records();
+
+  static Record &local() {
+    static thread_local Holder holder;
+    return *holder.record;
+  }
+
+public:
+  // cheap once online, called by every lookup
+  static void enter() {
+    Record &r = local();
+    if (r.online.load(std::memory_order_relaxed) == 0)
+      r.online.store(current.load());
+  }
+  static void offline() { local().online.store(0); }
+
+  // closes the current epoch, values retired before this call carry the
+  // returned tag
+  static uint64_t advance() { return current.fetch_add(1); }
+  // values tagged below it are out of reach of every thread
+  static uint64_t oldestOnline();
+};
+
+// Sharded map backing the compiled pattern caches below.
+// Keys are looked up by a precomputed hash, first in a small per-thread
+// table without locking, then under the shared lock of one shard.
+// With a byte budget set each shard evicts from its own queue with a second
+// chance for entries used since they were queued. Evicted values are retired
+// and freed on a later eviction once CacheEpoch shows no thread can hold them,
+// collect() frees the rest; only call it while no other thread uses the cache.
+template <typename Key, typename Value, size_t ShardCount = 16>
+class ShardedCache {
+public:
+  using Stats = CacheStats;
+
+private:
+  struct Node {
+    Key key;
+    size_t hash;
+    size_t bytes;
+    std::unique_ptr<Value> value;
+    std::atomic<bool> used{false}; // since it was last queued
+  };
+  struct Identity {
+    size_t operator()(size_t h) const { return h; }
+  };
+  struct alignas(64) Shard {
+    mutable std::shared_mutex mtx;
+    std::unordered_multimap<size_t, std::unique_ptr<Node>, Identity> map;
+    std::deque<Node*> queue; // eviction order, oldest first
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+  };
+  // per thread, direct mapped, invalidated by bumping generation
+  struct Slot {
+    const void* owner = nullptr;
+    uint64_t gen = 0;
+    size_t hash = 0;
+    Node* node = nullptr;
+  };
+  static constexpr size_t slotCount = 64;
+
+  Shard shards[ShardCount];
+  std::atomic<uint64_t> generation;
+  std::atomic<size_t> nextVictim{0}; // shard the next eviction starts at
+  std::atomic<size_t> totalBytes{0};
+  std::atomic<size_t> budget;
+  std::atomic<uint64_t> evictions{0};
+  std::mutex retiredMtx;
+  std::vector<std::pair<uint64_t, std::unique_ptr<Node>>> retired; // epoch tag, node
+
+  static Slot* slots() {
+    static thread_local Slot table[slotCount];
+    return table;
+  }
+  // unique across instances so a cache reusing an address starts cold
+  static uint64_t nextGeneration(uint64_t steps = 1) {
+    static std::atomic<uint64_t> counter{1};
+    return counter.fetch_add(steps) + steps;
+  }
+  Shard& shardOf(size_t hash) { return shards[(hash >> 6) % ShardCount]; }
+
+  Node* findLocked(Shard& shard, const Key& key, size_t hash) {
+    auto range = shard.map.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it) {
+      if (it->second->key == key)
+        return it->second.get();
+    }
+    return nullptr;
+  }
+
+  // gen must be read before the node was looked up, see evict()
+  void remember(Node* node, uint64_t gen) {
+    slots()[node->hash % slotCount] = Slot{this, gen, node->hash, node};
+  }
+
+  static void touch(Node* node) {
+    if (!node->used.load(std::memory_order_relaxed))
+      node->used.store(true, std::memory_order_relaxed);
+  }
+
+  // takes the oldest unused entries of one shard after another until back
+  // under budget, keep is the fresh insert
+  void evict(const Node* keep) {
+    size_t limit = budget.load();
+    if (limit == 0 || totalBytes.load() <= limit)
+      return;
+
+    std::vector<std::unique_ptr<Node>> victims;
+    size_t first = nextVictim.fetch_add(1);
+    for (size_t i = 0; i < ShardCount && totalBytes.load() > limit; i++) {
+      Shard& shard = shards[(first + i) % ShardCount];
+      std::unique_lock<std::shared_mutex> lock(shard.mtx);
+      // an entry used since it was queued goes to the back once, two rounds at most
+      for (size_t scan = 2 * shard.queue.size();
+           scan > 0 && !shard.queue.empty() && totalBytes.load() > limit; scan--) {
+        Node* candidate = shard.queue.front();
+        shard.queue.pop_front();
+        if (candidate == keep || candidate->used.exchange(false, std::memory_order_relaxed)) {
+          shard.queue.push_back(candidate);
+          continue;
+        }
+        auto range = shard.map.equal_range(candidate->hash);
+        for (auto it = range.first; it != range.second; ++it) {
+          if (it->second.get() != candidate)
+            continue;
+          totalBytes -= candidate->bytes;
+          evictions++;
+          victims.push_back(std::move(it->second));
+          shard.map.erase(it);
+          break;
+        }
+      }
+    }
+    if (victims.empty())
+      return;
+
+    // bumped after removal so no slot filled from now on can hold a retired node
+    generation.store(nextGeneration());
+    uint64_t tag = CacheEpoch::advance();
+    std::vector<std::unique_ptr<Node>> unreachable; // freed on return, outside the lock
+    {
+      uint64_t oldest = CacheEpoch::oldestOnline();
+      std::lock_guard<std::mutex> lock(retiredMtx);
+      for (auto& node : victims)
+        retired.emplace_back(tag, std::move(node));
+      auto kept = std::partition(retired.begin(), retired.end(),
+        [oldest](const auto& r) { return r.first >= oldest; });
+      for (auto it = kept; it != retired.end(); ++it)
+        unreachable.push_back(std::move(it->second));
+      retired.erase(kept, retired.end());
+    }
+  }
+
+public:
+  explicit ShardedCache(size_t budgetBytes = 0)
+    : generation(nextGeneration()), budget(budgetBytes) {}
+
+  ShardedCache(const ShardedCache&) = delete;
+  ShardedCache& operator=(const ShardedCache&) = delete;
+
+  // nullptr if absent
+  Value* find(const Key& key, size_t hash) {
+    CacheEpoch::enter();
+    uint64_t gen = generation.load();
+    Slot& slot = slots()[hash % slotCount];
+    if (slot.owner == this && slot.hash == hash && slot.gen == gen
+        && slot.node->key == key) {
+      shardOf(hash).hits.fetch_add(1, std::memory_order_relaxed);
+      touch(slot.node);
+      return slot.node->value.get();
+    }
+
+    Shard& shard = shardOf(hash);
+    Node* node;
+    {
+      std::shared_lock<std::shared_mutex> lock(shard.mtx);
+      node = findLocked(shard, key, hash);
+    }
+    if (node == nullptr) {
+      shard.misses.fetch_add(1, std::memory_order_relaxed);
+      return nullptr;
+    }
+    shard.hits.fetch_add(1, std::memory_order_relaxed);
+    touch(node);
+    remember(node, gen);
+    return node->value.get();
+  }
+
+  // keeps the existing value if another thread inserted the key first,
+  // the rejected value is destroyed; second is true when value was stored
+  std::pair<Value*, bool> insert(const Key& key, size_t hash, std::unique_ptr<Value> value, size_t bytes) {
+    CacheEpoch::enter();
+    uint64_t gen = generation.load();
+    Shard& shard = shardOf(hash);
+    Node* node;
+    {
+      std::unique_lock<std::shared_mutex> lock(shard.mtx);
+      node = findLocked(shard, key, hash);
+      if (node != nullptr) {
+        lock.unlock();
+        remember(node, gen);
+        return { node->value.get(), false };
+      }
+      auto fresh = std::make_unique<Node>();
+      fresh->key = key;
+      fresh->hash = hash;
+      fresh->bytes = bytes;
+      fresh->value = std::move(value);
+      node = fresh.get();
+      shard.map.emplace(hash, std::move(fresh));
+      shard.queue.push_back(node);
+    }
+    totalBytes += bytes;
+    evict(node);
+    remember(node, gen);
+    return { node->value.get(), true };
+  }
+
+  // make() returns std::unique_ptr<Value> and is called outside any lock,
+  // size(const Value&) approximates its memory for the budget
+  template <typename Make, typename Size>
+  Value* get(const Key& key, size_t hash, Make&& make, Size&& size) {
+    if (Value* hit = find(key, hash))
+      return hit;
+    std::unique_ptr<Value> value = make();
+    size_t bytes = size(*value);
+    return insert(key, hash, std::move(value), bytes).first;
+  }
+
+  // f(const Key&, Value&) for every live entry, under the shard locks
+  template <typename F>
+  void forEach(F&& f) {
+    for (auto& shard : shards) {
+      std::shared_lock<std::shared_mutex> lock(shard.mtx);
+      for (auto& [h, node] : shard.map)
+        f(node->key, *node->value);
+    }
+  }
+
+  // 0 disables eviction, a lower budget takes effect on the next insert
+  void setBudget(size_t bytes) { budget = bytes; }
+
+  // frees every retired value, returns how many
+  size_t collect() {
+    std::lock_guard<std::mutex> lock(retiredMtx);
+    size_t freed = retired.size();
+    retired.clear();
+    return freed;
+  }
+
+  Stats stats() const {
+    Stats s;
+    for (auto& shard : shards) {
+      s.hits += shard.hits.load(std::memory_order_relaxed);
+      s.misses += shard.misses.load(std::memory_order_relaxed);
+      std::shared_lock<std::shared_mutex> lock(shard.mtx);
+      s.entries += shard.map.size();
+    }
+    s.evictions = evictions.load();
+    s.bytes = totalBytes.load();
+    s.budget = budget.load();
+    return s;
+  }
+};
+
 // Thread-safe cache for compiled PCRE2 patterns.
 // Patterns are keyed by (pattern_string, compile_options).
 // The compiled pcre2_code* is owned by the cache for its lifetime.
 // Callers must NOT call pcre2_code_free on pointers returned by get().
+// Compiled patterns can be persisted with save() and restored with load(),
+// restored patterns are JIT compiled on first get() or by jitAll().
+// With setBudget() an evicted pattern stays valid until the thread that got
+// it goes offline, see CacheEpoch.
 class PcreCache {
+public:
   struct Key {
     std::string pattern;
     uint32_t    opts;
-    bool operator<(const Key &o) const {
-      return pattern < o.pattern || (pattern == o.pattern && opts < o.opts);
+    bool operator==(const Key &o) const {
+      return opts == o.opts && pattern == o.pattern;
     }
   };
-  std::map<Key, pcre2_code *> cache;
-  mutable std::mutex mtx;
+  using Stats = CacheStats;
 
-public:
-  PcreCache(){}
+  // hash once for patterns looked up over and over
+  static size_t hashPattern(const std::string &pattern) {
+    return std::hash<std::string>{}(pattern);
+  }
 
-  ~PcreCache() {
-    for (auto &[k, re] : cache)
-      pcre2_code_free(re);
-    cache.clear();
+private:
+  struct Entry {
+    pcre2_code *re = nullptr;
+    std::once_flag jit;
+    ~Entry() { pcre2_code_free(re); }
+  };
+  ShardedCache<Key, Entry> cache;
+  std::atomic<bool> dirty{false}; // compiled something not yet saved
+
+  static void jit(Entry &entry);
+  static size_t sizeOf(const Entry &entry);
+  size_t loadFile(const std::string &path);
+  static size_t hashKey(size_t patternHash, uint32_t opts) {
+    return patternHash ^ (opts * 0x9e3779b97f4a7c15ull);
   }
 
+public:
+  PcreCache(){}
+
   pcre2_code *get(const std::string &pattern, uint32_t opt_compile = PCRE2_CASELESS);
+  pcre2_code *get(const std::string &pattern, uint32_t opt_compile, size_t patternHash);
+
+  // on-disk cache, only valid for the PCRE2 version that wrote it, kept in
+  // the user's cache dir and only read back when this user owns it
+  // COPYPASTA_PCRE_CACHE overrides the path, set it empty to disable
+  // load() returns 0 for a missing or unusable file, it never throws
+  static std::string defaultPersistPath();
+  size_t load(const std::string &path = defaultPersistPath());
+  bool save(const std::string &path = defaultPersistPath());
+
+  // JIT compile every restored pattern in the background
+  void jitAll(ThreadPool &pool);
+
+  // bytes of compiled patterns to keep, 0 for unbounded
+  void setBudget(size_t bytes) { cache.setBudget(bytes); }
+  size_t collect() { return cache.collect(); }
+  Stats stats() const;
 
   // thread safe
   static PcreCache &global() {
@@ -107,11 +440,55 @@ public:
 };
 
 // Thread-safe query cache for reusing TSQuery* per engine and pattern
+// Same ownership rules as PcreCache, queries are never freed by callers.
 class TSQueryCache {
-  std::mutex mtx;
-  std::map<std::pair<const TSEngine*, std::string>, TSQuery*> cache;
+public:
+  struct Key {
+    const TSEngine *engine;
+    std::string pattern;
+    bool operator==(const Key &o) const {
+      return engine == o.engine && pattern == o.pattern;
+    }
+  };
+  using Stats = CacheStats;
+
+  static size_t hashPattern(const std::string &pattern) {
+    return std::hash<std::string>{}(pattern);
+  }
+
+  struct Entry {
+    TSQuery *query = nullptr;
+    QueryPredicates predicates; // parsed once, checked by CSTTree::find
+    ~Entry() { if (query) ts_query_delete(query); }
+  };
+
+private:
+  ShardedCache<Key, Entry> cache;
+
+  static size_t hashKey(const TSEngine *engine, size_t patternHash) {
+    return patternHash ^ (std::hash<const void*>{}(engine) * 0x9e3779b97f4a7c15ull);
+  }
+
 public:
   TSQuery* get(const TSEngine* engine, const std::string& pattern); 
+  TSQuery* get(const TSEngine* engine, const std::string& pattern, size_t patternHash);
+  // the query with its predicates, pass both to CSTTree::find
+  const Entry &entry(const TSEngine *engine, const std::string &pattern);
+  const Entry &entry(const TSEngine *engine, const std::string &pattern, size_t patternHash);
+
+  // several queries compiled as one, owner[pattern index] is the position
+  // of the source query in patterns. Cached like any other query
+  struct Combined {
+    const Entry *entry = nullptr;
+    std::vector<uint32_t> owner;
+  };
+  Combined combine(const TSEngine *engine, const std::vector<std::string> &patterns);
+
+  // approximate bytes of queries to keep, 0 for unbounded
+  void setBudget(size_t bytes) { cache.setBudget(bytes); }
+  size_t collect() { return cache.collect(); }
+  Stats stats() const;
+
   // thread safe
   static TSQueryCache &global() {
     static TSQueryCache instance;
@@ -26,6 +26,13 @@ public:
   std::set<std::string> ignore;
   std::set<std::string> matchExt;
 
+  enum CONTENT {
+    ANY,      // files are not looked into
+    MARK,     // File::kind is set from the first block, the action decides
+    TEXT_ONLY // binary, generated and minified files never reach the action
+  };
+  CONTENT content = ANY;
+
   enum STATUS {
     QUEUING, // file queued for processing; may be skipped based on action result
     OPENED,  // file is opened for processing
@@ -62,6 +69,19 @@ public:
     inverted      = other->inverted;
     matchExt      = other->matchExt;
     filesOnly     = other->filesOnly;
+    content       = other->content;
+  }
+
+  // false if the file should not reach the action
+  static bool classify(File &file, CONTENT content) {
+    if (content == ANY || !file.isReg)
+      return true;
+    file.kind = ContentClassifier::global().classify(file.pathStr);
+    if (content == TEXT_ONLY && file.kind != ContentClassifier::TEXT) {
+      DEBUG("DirWalker skip " << ContentClassifier::name(file.kind) << " - \n" << file.pathStr);
+      return false;
+    }
+    return true;
   }
 
   ~DirWalker() {
@@ -164,7 +184,10 @@ DirWalker::STATUS DirWalker::walk(LibGit& repo, Action &&action,
     File file(entries[i]);
     file.level = level;
 
-  
+    if (!classify(file, content)) {
+      continue;
+    }
+
     ACTION actRes;
     if(!filesOnly || !file.isDir){
       DEBUG("DirWalker walk do job - \n" << file.pathStr);
@@ -296,7 +319,7 @@ void DirWalker::walk(LibGit& repo, ThreadPool &pool, Action &&action,
     }
     if (actRes == ACTION::ABORT) {
       DEBUG("DirWalker with pool abort - \n" << file.pathStr);
-      abortSignal->store(true);
+      abortSignal->store(true); // queued jobs mid parse see it through their Scope
       return;
     }
  
@@ -323,11 +346,18 @@ void DirWalker::walk(LibGit& repo, ThreadPool &pool, Action &&action,
 
       DEBUG_FULL("DirWalker walk with pool enqueue job - \n" << file.pathStr);
       // create a anonlymous class that has action and file in constructor
-      pool.enqueue([action, file, &repo, abortSignal, &payload]() {
+      // classified in the job so the walk does not wait on reads,
+      // child walkers are gone by then so the mode is copied
+      pool.enqueue([action, file, &repo, abortSignal, &payload, mode = content]() mutable {
         if (abortSignal->load())
           return;
 
+        if (!classify(file, mode))
+          return;
+
         DEBUG("DirWalker walk with pool do job - \n" << file.pathStr);
+        // parses in this job stop when any job of this walk aborts, not others
+        ParseControl::Scope parseScope(abortSignal.get());
         ACTION actRes = callAction(action, OPENED, file, repo, payload);
         DEBUG("DirWalker walk with pool job done - \n" << file.pathStr);
         if (actRes == ACTION::ABORT) {
@@ -40,7 +40,8 @@ namespace copypasta {
 #define FOREACH_ERROR(ERR)                                                     \
   ERR(CONFLICT)                                                                \
   ERR(CST_ERROR)                                                               \
-  ERR(CST_MISSING)
+  ERR(CST_MISSING)                                                             \
+  ERR(CST_UNPARSED) // the reparse was aborted, the edits could not be checked
 
 class FileEditor {
 public:
@@ -92,6 +93,14 @@ private:
   std::vector<Error> errors;
 
   static TSPoint getNewEndPoint(const Edit& edit);
+  static bool isByteRangeOp(OP op) {
+    return op == OP_WRITE || op == OP_INSERT || op == OP_DELETE;
+  }
+  // ops addressing rows, moved along when the byte range batch runs first
+  static bool isRowOp(OP op) {
+    return op == OP_INSERT_ROW_BEFORE || op == OP_INSERT_ROW_AFTER || op == OP_MARK;
+  }
+  OffsetMap applyByteRangeEdits(CSTTree &tree, FileWriter &writer);
 };
 
 } // namespace copypasta 
@@ -5,16 +5,54 @@
 #include <fstream>
 #include <string>
 #include <vector>
+#include <functional>
+#include <optional>
+#include <mutex>
+#include <atomic>
 
 #define PCRE2_CODE_UNIT_WIDTH 8
 #include <pcre2.h>
 
 #include <tree_sitter/api.h>
 
+#include <PieceTable.hpp>
+
 namespace copypasta {
 
 namespace fs = std::filesystem;
 
+class ThreadPool;
+
+// Cheap look at the first block of a file to keep binary, generated and
+// minified content away from parsers and regex, configure through global()
+class ContentClassifier {
+public:
+  enum KIND {
+    UNKNOWN,   // not classified yet
+    TEXT,
+    BINARY,    // NUL bytes or mostly invalid UTF-8
+    GENERATED, // carries one of the generated markers near the top
+    MINIFIED   // lines too long to be written by hand
+  };
+
+  size_t sampleSize = 8 * 1024;
+  double maxInvalidUtf8 = 0.01;  // ratio of bytes in broken sequences
+  size_t markerLines = 10;       // markers are only looked for in the header
+  std::vector<std::string> generatedMarkers = {"@generated", "DO NOT EDIT",
+                                               "auto-generated", "Code generated by"};
+  size_t maxLineLength = 4096;
+  size_t maxAvgLineLength = 300; // only checked once the sample has a few lines
+
+  static ContentClassifier &global() {
+    static ContentClassifier instance;
+    return instance;
+  }
+
+  static const char *name(KIND kind);
+  KIND classify(std::string_view sample) const;
+  KIND classify(const std::string &path) const; // reads sampleSize bytes
+};
+
 class File {
 public:
   std::string pathStr;
@@ -28,11 +66,16 @@ public:
   fs::path path;
   fs::file_status status;
   fs::directory_entry dir_entry;
+  ContentClassifier::KIND kind = ContentClassifier::UNKNOWN;
 
   // TODO: hotspot
   File(std::string path);
   File(fs::directory_entry entry);
   File();
+  File(const File &) = default;
+  File(File &&) noexcept = default;
+  File &operator=(const File &) = default;
+  File &operator=(File &&) noexcept = default;
   // hotspot
   ~File();
 
@@ -47,7 +90,7 @@ public:
 };
 
 struct FileSnapshot {
-  std::string cont;
+  SharedText cont; // shared with the reader or writer it came from
   File file;
   size_t lastModified;
   bool dirty;
@@ -57,16 +100,20 @@ class FileReader {
   File file;
   void readFileMetadata();
   bool _isValid = false;
-  size_t pos;
+  size_t pos = 0;
 
   static const char *tsRead(void *payload, uint32_t byte_index, TSPoint point,
                             uint32_t *bytes_read);
 
-  std::vector<char> buf;
+  SharedText buf; // shared with snapshots, copied only if loaded into while shared
 
   bool rowOffsetsValid = false;
+  size_t rowOffsetsEnd = 0; // bytes of buf already scanned for '\n'
   std::vector<size_t> rowOffsets;
 
+  size_t loadUpTo(size_t to); // grows buf to cover [0, to), returns loaded end
+  void loadFirstBlock(); // construction reads nothing, accessors that show buf call this
+
 public:
   size_t level = 0;
 
@@ -75,22 +122,29 @@ public:
   size_t bufSize = 0;
   static constexpr size_t defaultBlockSize = 1024 * 1024;
   size_t blockSize = defaultBlockSize;
-  bool readReverse;
+  size_t parallelChunkSize = 8 * defaultBlockSize; // split size for pool search
+  bool readReverse = false;
   bool snapshotMode = false; // disables fresh load and sync
 
   FileReader(File file, size_t blockSize = defaultBlockSize);
   FileReader(std::string filePath, size_t blockSize = defaultBlockSize);
   FileReader(const FileSnapshot snap, size_t blockSize = defaultBlockSize);
-  FileReader(const FileReader &copy);
+  FileReader(const FileReader &copy); // shares buf, copies row offsets
+  FileReader(FileReader &&other) noexcept;
+  FileReader &operator=(const FileReader &copy);
+  FileReader &operator=(FileReader &&other) noexcept;
   FileReader() {};
   ~FileReader();
 
   bool isValid() { return _isValid; };
   File getFile() { return file; };
+  // classifies the first sample of the content once, kept on the File
+  ContentClassifier::KIND classify();
   const std::vector<size_t>& getRowOffsets(); 
+  const SharedText &shared() const { return buf; } // loaded content, no copy
 
   typedef struct {
-    char *cont;
+    const char *cont;
     size_t size;
   } block;
 
@@ -123,6 +177,86 @@ public:
   std::vector<MatchResult> findWith(pcre2_code *re,
                                     uint32_t opt_match = PCRE2_NO_UTF_CHECK); // some compile 
                                                                               // options allowed 
+
+  // streaming search, matches are handed to the sink without being materialised
+  // offsets are absolute, ovector is null for literal search
+  typedef struct {
+    size_t start;
+    size_t end;
+    const PCRE2_SIZE *ovector; // pairs as returned by pcre2, [0] is the match
+    int pairs;
+    std::string_view text;
+  } MatchView;
+
+  // return false from the sink to stop the search
+  using MatchSink = std::function<bool(const MatchView &)>;
+
+  // returns number of matches handed to the sink
+  size_t findEach(const std::string &pattern, const MatchSink &sink,
+                  bool regex = false, uint32_t opt_compile = PCRE2_CASELESS);
+  size_t findEachWith(pcre2_code *re, const MatchSink &sink,
+                      uint32_t opt_match = PCRE2_NO_UTF_CHECK);
+
+  // fast paths, stop at first hit / skip row and column computation
+  bool exists(const std::string &pattern, bool regex = false,
+              uint32_t opt_compile = PCRE2_CASELESS);
+  size_t count(const std::string &pattern, bool regex = false,
+               uint32_t opt_compile = PCRE2_CASELESS);
+  std::optional<MatchResult> findFirst(const std::string &pattern, bool regex = false,
+                                       uint32_t opt_compile = PCRE2_CASELESS);
+
+  MatchResult toMatchResult(const MatchView &view);
+
+  // columnar match storage, clear() keeps capacity so one buffer can be
+  // reused across files; rows and columns are filled in bulk by resolve()
+  struct MatchBuffer {
+    std::vector<size_t> start;
+    std::vector<size_t> end;
+    std::vector<size_t> capBegin; // per match index into cap*, size() + 1 entries
+    std::vector<size_t> capStart; // PCRE2_UNSET when the group did not participate
+    std::vector<size_t> capEnd;
+
+    std::vector<TSPoint> startPoint;
+    std::vector<TSPoint> endPoint;
+    std::vector<TSPoint> capStartPoint;
+    std::vector<TSPoint> capEndPoint;
+    bool resolved = false;
+
+    void clear();
+    void push(const MatchView &view);
+    size_t size() const { return start.size(); }
+    size_t captureCount(size_t i) const { return capBegin[i + 1] - capBegin[i]; }
+
+    // single merge walk over rowOffsets, matches must be in document order
+    void resolve(const std::vector<size_t> &rowOffsets);
+
+    // require resolve()
+    TSRange range(size_t i) const;
+    TSRange capture(size_t i, size_t j) const;
+    std::vector<MatchResult> toMatchResults() const;
+    void pushFrom(const MatchBuffer &other, size_t i);
+  };
+
+  // clears out and fills it, returns number of matches
+  size_t findInto(MatchBuffer &out, const std::string &pattern, bool regex = false,
+                  uint32_t opt_compile = PCRE2_CASELESS);
+  size_t findWithInto(MatchBuffer &out, pcre2_code *re,
+                      uint32_t opt_match = PCRE2_NO_UTF_CHECK);
+  void resolve(MatchBuffer &out); // reads past the loaded content without keeping it
+
+  // splits the file into chunks searched concurrently on the pool, the
+  // result is identical to the sequential search; safe to call from a
+  // pool worker as the calling thread searches chunks as well. Workers read
+  // their chunk on their own, the content is not loaded into the reader
+  std::vector<MatchResult> find(ThreadPool &pool, const std::string &pattern,
+                                bool regex = false,
+                                uint32_t opt_compile = PCRE2_CASELESS);
+  std::vector<MatchResult> findWith(ThreadPool &pool, pcre2_code *re,
+                                    uint32_t opt_match = PCRE2_NO_UTF_CHECK);
+  size_t findInto(ThreadPool &pool, MatchBuffer &out, const std::string &pattern,
+                  bool regex = false, uint32_t opt_compile = PCRE2_CASELESS);
+  size_t findWithInto(ThreadPool &pool, MatchBuffer &out, pcre2_code *re,
+                      uint32_t opt_match = PCRE2_NO_UTF_CHECK);
   TSPoint getP(size_t byteOffset);
 
   FileSnapshot snapshot();
@@ -194,29 +328,99 @@ public:
 TSPoint _getP(size_t byteOffset, const std::vector<size_t>& rowOffsets);
 TSRange _makeRange(size_t start, size_t end, const std::vector<size_t>& rowOffsets);
 
+// replace bytes [from, to) with text, from == to inserts
+struct TextEdit {
+  size_t from;
+  size_t to;
+  std::string text;
+};
+
+// where FileWriter::applyBatch moved the content, entries ascending
+struct OffsetMap {
+  struct Entry {
+    size_t oldFrom;
+    size_t oldTo;
+    size_t newFrom;
+    size_t newTo;
+  };
+  std::vector<Entry> entries;
+
+  // offsets inside a replaced range map to the end of its replacement,
+  // text at an insertion point ends up after the inserted text
+  size_t map(size_t oldOffset) const;
+};
+
+struct SaveStats {
+  size_t saved = 0;
+  size_t skipped = 0; // content matched the file on disk
+  size_t failed = 0;
+};
+
+// Durability for a run of saves. save() syncs each temp file and renames it
+// into place right away, flush() then syncs every touched directory once
+// so the renames survive a crash.
+class SaveBatch {
+  std::mutex mtx;
+  std::vector<std::string> dirs; // parents of files renamed since the last flush
+  std::atomic<size_t> saved{0};
+  std::atomic<size_t> skipped{0};
+  std::atomic<size_t> failed{0};
+
+public:
+  static SaveBatch &global() {
+    static SaveBatch instance;
+    return instance;
+  }
+
+  void recordSaved(const fs::path &file);
+  void recordSkipped() { skipped++; };
+  void recordFailed() { failed++; };
+
+  bool flush();
+  SaveStats stats() const { return {saved.load(), skipped.load(), failed.load()}; };
+  void reset();
+};
+
 class FileWriter {
   File file;
-  bool _isValid;
+  bool _isValid = false;
   std::ofstream oFileStream;
-  FileSnapshot snap;
+  FileSnapshot snap; // metadata only, the text lives in cont
+  PieceTable cont;
   bool rowOffsetsValid = false;
   std::vector<size_t> rowOffsets;
 
+  // every edit goes through here so valid row offsets stay valid
+  void splice(size_t from, size_t to, std::string_view text);
+  OffsetMap substitute(pcre2_code *re, const std::string &templateOrResult,
+                       bool all, size_t nth, uint32_t opt);
+
 public:
   FileWriter(const FileSnapshot snap);
   FileWriter(std::string path);
   FileWriter(File f);
-  FileWriter(const FileWriter &copy);
+  FileWriter(const FileWriter &copy); // shares every piece
+  FileWriter(FileWriter &&other) noexcept;
+  FileWriter &operator=(const FileWriter &copy);
+  FileWriter &operator=(FileWriter &&other) noexcept;
   ~FileWriter();
 
   bool isValid() { return _isValid; };
+  bool isDirty() const { return snap.dirty; };
   File getFile() { return file; };
-  const FileSnapshot snapshot() const { return snap; };
+  const FileSnapshot snapshot() const; // flattens the content
+  const PieceTable &content() const { return cont; };
+  size_t size() const { return cont.size(); };
+  TSInput asTsInput() const { return cont.asTsInput(); };
   const std::vector<size_t>& getRowOffsets(); 
 
   TSPoint getP(size_t byteOffset);
 
-  bool save(); // save buf to underling file
+  // writes and syncs a temp file and renames it over the original, skipped if
+  // the file on disk already has this content, the rename is made durable by
+  // SaveBatch::flush
+  bool save();
+  bool sameAsDisk() const;
   bool backup(const std::string &suffix = ".bak"); // create a backup in same folder
   bool writeTo(const std::string &path); // create file if non existing , will over write existing
 
@@ -235,6 +439,14 @@ public:
   FileWriter &deleteRow(size_t row);
   FileWriter &deleteCont(size_t from, size_t to);
 
+  // one match and splice pass over the content, the template is expanded
+  // per match, returns the changed ranges for tree updates
+  OffsetMap substituteAll(pcre2_code *re, const std::string &templateOrResult,
+                          uint32_t opt = PCRE2_SUBSTITUTE_EXTENDED);
+  // only the nth match, 0 for first and -1 for last like replace
+  OffsetMap substituteNth(pcre2_code *re, const std::string &templateOrResult,
+                          size_t nth, uint32_t opt = PCRE2_SUBSTITUTE_EXTENDED);
+
   FileWriter &replace(const std::string& pattern, 
                       const std::string& templateOrResult,
                       size_t nth_occ = 0, // 0 for first 1 for second and
@@ -245,6 +457,21 @@ public:
                       const std::string& templateOrResult,
                       uint32_t opt = PCRE2_SUBSTITUTE_GLOBAL |
                                       PCRE2_SUBSTITUTE_EXTENDED);
+
+  // all ranges refer to the content before the call, in any order
+  // throws std::invalid_argument if two ranges overlap
+  OffsetMap applyBatch(std::vector<TextEdit> edits);
+
+  // applies edits like applyBatch straight from path to target (path if empty)
+  // without loading it, unchanged bytes are copied file to file in the kernel
+  // when possible, the result goes to a temp file renamed over target, so
+  // memory stays proportional to the edits, throws std::runtime_error on io errors
+  static OffsetMap rewrite(const std::string &path, std::vector<TextEdit> edits,
+                           const std::string &target = "");
+
+  // a temp file name beside dest, unique per process and call, for writing
+  // aside and renaming over dest
+  static std::string tempPathFor(const std::string &dest);
 };
 
 } // namespace copypasta
@@ -10,6 +10,7 @@
 #include <git2/types.h>
 
 #include <string>
+#include <memory>
 #include <mutex>
 #include <vector>
 #include <filesystem>
@@ -26,11 +27,12 @@ class LibGit {
  
   RepoPtr repo;
   std::string root;
-  std::mutex gitMutex;
+  // copies share the repository handle, so they share its lock too
+  std::shared_ptr<std::mutex> gitMutex = std::make_shared<std::mutex>();
   
   std::string username = "copyPasta";
   std::string email = "manishelf@proton.me";
-  git_signature* signature;
+  git_signature* signature = nullptr;
 
   static std::once_flag lib_git_init;
   static void init();
@@ -40,8 +42,10 @@ public:
   LibGit(git_repository *repo);
   ~LibGit();
 
-  LibGit(LibGit&& other); 
-  LibGit(const LibGit& other);
+  LibGit(LibGit&& other) noexcept;
+  LibGit(const LibGit& other); // shares the repository, no reopen
+  LibGit& operator=(LibGit&& other) noexcept;
+  LibGit& operator=(const LibGit& other);
 
   static LibGit clone(std::string url, std::string path = ".", 
                       bool shallow = false, git_clone_options opts = GIT_CLONE_OPTIONS_INIT);
@@ -30,6 +30,7 @@ class LuaExecutor {
 
   bool watcherRunning = false;
   ThreadPool pool;
+  ThreadPool background; // warm up work that must not delay the script
   void watchAndExec(const std::string& path, int pollIntervalMs);
 public:
 
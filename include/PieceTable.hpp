@@ -0,0 +1,127 @@
+#ifndef PIECE_TABLE_HPP
+#define PIECE_TABLE_HPP
+
+#include <memory>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+#include <tree_sitter/api.h>
+
+#include <SharedText.hpp>
+
+namespace copypasta {
+
+// Editable text as pieces of immutable buffers held in a persistent treap.
+// insert/erase are O(log pieces) and never move existing text,
+// copies share every node so a copy is an O(1) snapshot.
+// Text is only made contiguous by str()/substr()/flatten(), writeTo()
+// streams pieces.
+class PieceTable {
+  struct Piece {
+    std::shared_ptr<const std::string> buf;
+    size_t start = 0;
+    size_t len = 0;
+    std::string_view view() const { return std::string_view(buf->data() + start, len); }
+  };
+  struct Node;
+  using NodePtr = std::shared_ptr<const Node>;
+  struct Node {
+    Piece piece;
+    NodePtr left;
+    NodePtr right;
+    size_t size; // bytes in this subtree
+    uint32_t prio;
+  };
+
+  // splitting a piece is O(1), bounding it keeps TSInput reads cache friendly
+  static constexpr size_t maxPieceSize = 64 * 1024;
+
+  NodePtr root;
+  mutable SharedText flat; // contiguous copy of the content, reset by every edit
+
+  static size_t sizeOf(const NodePtr &n) { return n ? n->size : 0; }
+  static NodePtr make(const Piece &piece, NodePtr left, NodePtr right, uint32_t prio);
+  static NodePtr merge(const NodePtr &a, const NodePtr &b);
+  static void split(NodePtr n, size_t at, NodePtr &left, NodePtr &right);
+  static void chunk(const std::shared_ptr<const std::string> &buf, std::vector<Piece> &into);
+  static NodePtr build(const std::vector<Piece> &pieces, size_t lo, size_t hi);
+  static NodePtr build(std::shared_ptr<const std::string> buf);
+  static void collect(const Node *n, std::vector<Piece> &into);
+
+  template <typename F>
+  static bool visit(const Node *n, size_t base, size_t from, size_t to, F &f) {
+    if (n == nullptr || from >= to)
+      return true;
+    size_t leftSize = sizeOf(n->left);
+    size_t pieceStart = base + leftSize;
+    size_t pieceEnd = pieceStart + n->piece.len;
+    if (from < pieceStart && !visit(n->left.get(), base, from, to, f))
+      return false;
+    if (from < pieceEnd && to > pieceStart) {
+      size_t s = std::max(from, pieceStart) - pieceStart;
+      size_t e = std::min(to, pieceEnd) - pieceStart;
+      if (!f(n->piece.view().substr(s, e - s)))
+        return false;
+    }
+    if (to > pieceEnd)
+      return visit(n->right.get(), pieceEnd, from, to, f);
+    return true;
+  }
+
+  static const char *tsRead(void *payload, uint32_t byte_index, TSPoint point,
+                            uint32_t *bytes_read);
+
+public:
+  PieceTable() = default;
+  explicit PieceTable(std::string content);
+
+  size_t size() const { return sizeOf(root); }
+  bool empty() const { return root == nullptr; }
+
+  void assign(std::string content);
+  void assign(const SharedText &content); // shares the bytes, no copy
+  void insert(size_t offset, std::string_view text);
+  void append(std::string_view text) { insert(size(), text); }
+  void erase(size_t from, size_t to);
+  void replace(size_t from, size_t to, std::string_view text);
+
+  struct Splice {
+    size_t from;
+    size_t to;
+    std::string_view text;
+  };
+  // applies ascending, non overlapping splices by rebuilding the tree once,
+  // O(pieces + splices + inserted bytes) instead of one path copy per edit
+  void splice(const std::vector<Splice> &sorted);
+
+  char at(size_t offset) const;
+  // contiguous text from offset up to the end of its piece, empty past the end
+  std::string_view chunkAt(size_t offset) const;
+  std::string substr(size_t from, size_t len = std::string::npos) const;
+  std::string str() const; // always copies
+  // contiguous content, copies once after an edit and is shared after that
+  SharedText flatten() const;
+
+  // f(std::string_view) for the chunks covering [from, to), return false to stop
+  template <typename F>
+  void forEachChunk(size_t from, size_t to, F &&f) const {
+    visit(root.get(), 0, from, std::min(to, size()), f);
+  }
+  template <typename F>
+  void forEachChunk(F &&f) const {
+    forEachChunk(0, size(), std::forward<F>(f));
+  }
+
+  bool writeTo(std::ostream &os) const;
+
+  // reads straight from the pieces, the table must outlive the parse
+  TSInput asTsInput() const;
+};
+
+} // namespace copypasta
+
+#endif // PIECE_TABLE_HPP
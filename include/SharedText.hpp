@@ -0,0 +1,71 @@
+#ifndef SHARED_TEXT_HPP
+#define SHARED_TEXT_HPP
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace copypasta {
+
+// Refcounted file content shared by FileReader, FileWriter and CSTTree.
+// Copies share the bytes, mut() copies first if anyone else holds them.
+class SharedText {
+  std::shared_ptr<const std::string> text;
+
+  static const std::string &none() {
+    static const std::string empty;
+    return empty;
+  }
+
+public:
+  SharedText() = default;
+  explicit SharedText(std::string s)
+      : text(std::make_shared<std::string>(std::move(s))) {}
+  // s must point to a string that was not created const, see mut()
+  explicit SharedText(std::shared_ptr<const std::string> s) : text(std::move(s)) {}
+
+  SharedText &operator=(std::string s) {
+    text = std::make_shared<std::string>(std::move(s));
+    return *this;
+  }
+
+  const std::string &str() const { return text ? *text : none(); }
+  operator const std::string &() const { return str(); }
+  operator std::string_view() const { return str(); }
+
+  const char *data() const { return str().data(); }
+  const char *c_str() const { return str().c_str(); }
+  size_t size() const { return str().size(); }
+  size_t length() const { return str().length(); }
+  bool empty() const { return str().empty(); }
+  std::string::const_iterator begin() const { return str().begin(); }
+  std::string::const_iterator end() const { return str().end(); }
+  std::string substr(size_t pos, size_t n = std::string::npos) const {
+    return str().substr(pos, n);
+  }
+
+  // whole buffer copies made so far, counted where file content is duplicated
+  static std::atomic<size_t> &copies() {
+    static std::atomic<size_t> count{0};
+    return count;
+  }
+  static void countCopy() { copies().fetch_add(1, std::memory_order_relaxed); }
+
+  bool shared() const { return text.use_count() > 1; }
+  const std::shared_ptr<const std::string> &share() const { return text; }
+
+  // copy on write, the only way to change the bytes
+  std::string &mut() {
+    if (!text || text.use_count() > 1) {
+      if (!str().empty())
+        countCopy();
+      text = std::make_shared<std::string>(str());
+    }
+    return const_cast<std::string &>(*text);
+  }
+};
+
+} // namespace copypasta
+
+#endif // SHARED_TEXT_HPP
@@ -6,6 +6,9 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <mutex>
+#include <atomic>
+#include <stdexcept>
 
 #include <FileReaderWriter.hpp>
 #include <Logger.hpp>
@@ -13,6 +16,54 @@
 namespace copypasta {
 
 class TSEngine;
+class CSTTree;
+
+// Text predicates of a query. tree-sitter parses them but leaves the checks
+// to the caller, these are parsed once per query, see TSQueryCache.
+// #eq? / #not-eq? against a string or a second capture, #match? / #not-match?
+// through PcreCache, #any-of? / #not-any-of? against a list, the any- forms
+// pass when one captured node does. Other predicates are ignored.
+class QueryPredicates {
+public:
+  enum KIND { EQ, MATCH, ANY_OF };
+  struct Predicate {
+    KIND kind;
+    bool negate = false;
+    bool any = false;
+    uint32_t capture = 0;
+    uint32_t otherCapture = UINT32_MAX; // #eq? between two captures
+    std::vector<std::string> values;    // the list for any-of, else one value
+    size_t patternHash = 0;             // of values[0] for MATCH
+  };
+
+private:
+  std::vector<std::vector<Predicate>> byPattern;
+  bool none = true;
+
+  static bool holds(const Predicate &p, const TSQueryMatch &match, CSTTree &tree);
+
+public:
+  QueryPredicates() = default;
+  explicit QueryPredicates(const TSQuery *query);
+
+  bool empty() const { return none; }
+  // every predicate of the pattern the match came from holds
+  bool matches(const TSQueryMatch &match, CSTTree &tree) const;
+};
+
+// TSQueryCursor from a per thread pool, given back with its ranges cleared
+// on destruction. A find nested in another find's handler takes a second one
+class QueryCursor {
+  TSQueryCursor *cursor;
+
+public:
+  QueryCursor();
+  QueryCursor(const QueryCursor &) = delete;
+  QueryCursor &operator=(const QueryCursor &) = delete;
+  ~QueryCursor();
+  TSQueryCursor *get() const { return cursor; }
+};
+
 class CSTTree {
 private:
   struct TSTreeDeleter {
@@ -22,67 +73,316 @@ private:
   };
 
   std::unique_ptr<TSTree, TSTreeDeleter> tree;
-  std::string_view source;
+  std::string_view source; // contiguous text, only made on demand when fromPieces
+  SharedText owner; // keeps source alive when the tree was given the text
+  PieceTable pieces; // writer content the tree was parsed from, O(1) to hold
+  bool fromPieces = false;
   TSEngine* parent;
+  bool injected = false; // parsed only inside ts_tree_included_ranges
+  std::string origin; // file the tree was parsed from, names aborted reparses
+  bool stale = false; // the last reparse was aborted, see reparse()
+  bool deferEdits = false;
+  size_t pendingEdits = 0; // applied with ts_tree_edit but not reparsed yet
+  std::vector<TSRange> changed; // since clearChanges(), in current coordinates
+
+  void setSource(const PieceTable &text);
+  void setSource(SharedText text);
+  void reparse();
+
+  template <typename cb> 
+  void run(QueryCursor &cursor, TSQuery *query, const QueryPredicates &predicates,
+           TSNode node, cb handle) {
+      DEBUG("CSTTree find start");
+      ts_query_cursor_exec(cursor.get(), query, node);
+      TSQueryMatch match;
+
+      while (ts_query_cursor_next_match(cursor.get(), &match)) {
+        if (!predicates.empty() && !predicates.matches(match, *this))
+          continue;
+        DEBUG("CSTTree find handle start");
+        handle(match);
+        DEBUG("CSTTree find handle end");
+      }
+      DEBUG("CSTTree find end");
+  }
+  void recordEdit(const TSInputEdit &ed);
+
+  // smaller files are not worth a tree copy and a pool task per chunk
+  static constexpr uint32_t parallelChunkSize = 256 * 1024;
+  // matches kept by findParallel, each match's captures point into captures
+  struct MatchList {
+    std::vector<TSQueryMatch> matches;
+    std::vector<TSQueryCapture> captures;
+  };
+  MatchList collectParallel(ThreadPool &pool, TSQuery *query, const QueryPredicates &predicates);
 
 public:
   friend TSEngine;
 
   CSTTree(TSTree *tree, std::string_view source, TSEngine* parent);
-  CSTTree(const CSTTree& other);
+  CSTTree(TSTree *tree, SharedText source, TSEngine* parent);
+  CSTTree(TSTree *tree, PieceTable source, TSEngine* parent);
+  CSTTree(const CSTTree& other); // ts_tree_copy, shares the source
+  CSTTree(CSTTree&& other) noexcept;
+  CSTTree& operator=(const CSTTree& other);
+  CSTTree& operator=(CSTTree&& other) noexcept;
   ~CSTTree();
 
   std::string asSexpr();
   std::string asQuery();
   void getQueryForNode(TSNode node, std::string &query, size_t level = 0);
   std::string getText(TSNode n);
+  bool textEquals(TSNode n, std::string_view text); // no copy of the node text
 
+  // checks the query's predicates, parsing them for this call, queries
+  // from TSQueryCache come with theirs already parsed
   template <typename cb> 
   void find(TSQuery *query, cb handle) {
-      DEBUG("CSTTree find start");
-      TSNode root = ts_tree_root_node(tree.get());
-      TSQueryCursor *cursor = ts_query_cursor_new();
-      ts_query_cursor_exec(cursor, query, root);
-      TSQueryMatch match;
+      find(query, 0, UINT32_MAX, handle);
+  }
 
-      while (ts_query_cursor_next_match(cursor, &match)) {
-        DEBUG("CSTTree find handle start");
+  // only matches intersecting [startByte, endByte)
+  template <typename cb> 
+  void find(TSQuery *query, uint32_t startByte, uint32_t endByte, cb handle) {
+      QueryPredicates predicates(query);
+      find(query, predicates, startByte, endByte, handle);
+  }
+
+  template <typename cb> 
+  void find(TSQuery *query, const QueryPredicates &predicates, cb handle) {
+      find(query, predicates, 0, UINT32_MAX, handle);
+  }
+
+  template <typename cb> 
+  void find(TSQuery *query, const QueryPredicates &predicates,
+            uint32_t startByte, uint32_t endByte, cb handle) {
+      flush();
+      QueryCursor cursor;
+      ts_query_cursor_set_byte_range(cursor.get(), startByte, endByte);
+      run(cursor, query, predicates, ts_tree_root_node(tree.get()), handle);
+  }
+
+  // only matches intersecting [start, end) in rows and columns
+  template <typename cb> 
+  void find(TSQuery *query, const QueryPredicates &predicates,
+            TSPoint start, TSPoint end, cb handle) {
+      flush();
+      QueryCursor cursor;
+      ts_query_cursor_set_point_range(cursor.get(), start, end);
+      run(cursor, query, predicates, ts_tree_root_node(tree.get()), handle);
+  }
+
+  // only matches inside scope, a node of this tree as it is now, nothing is
+  // flushed since that would invalidate the node
+  template <typename cb> 
+  void find(TSQuery *query, const QueryPredicates &predicates, TSNode scope, cb handle) {
+      QueryCursor cursor;
+      run(cursor, query, predicates, scope, handle);
+  }
+
+  // one pass for several queries compiled into one, see TSQueryCache::combine,
+  // handle(owner[pattern], match) tells the source query apart
+  template <typename cb> 
+  void findMany(TSQuery *query, const QueryPredicates &predicates,
+                const std::vector<uint32_t> &owner, cb handle) {
+      find(query, predicates, [&owner, &handle](TSQueryMatch match) {
+        handle(owner[match.pattern_index], match);
+      });
+  }
+
+  // find over chunks of the tree searched on the pool, for very large files.
+  // matches reach handle on this thread and in the order find gives them
+  template <typename cb> 
+  void findParallel(ThreadPool &pool, TSQuery *query, const QueryPredicates &predicates, cb handle) {
+      flush();
+      if (sourceSize() < 2 * parallelChunkSize) {
+        find(query, predicates, handle);
+        return;
+      }
+      auto found = collectParallel(pool, query, predicates);
+      for (auto &match : found.matches) {
         handle(match);
-        DEBUG("CSTTree find handle end");
       }
+  }
 
-      ts_query_cursor_delete(cursor);
-      DEBUG("CSTTree find end");
-    }
+  // ranges of the nodes captured as capture, of every capture when empty,
+  // in document order. Input for TSEngine::inject
+  std::vector<TSRange> captureRanges(TSQuery *query, const QueryPredicates &predicates,
+                                     const std::string &capture = "");
 
   bool validate(const TSInputEdit edit, size_t insertL = 0, size_t delL = 0);
   void edit(const TSInputEdit edit, const std::string_view source);
+  void edit(const TSInputEdit edit, SharedText source);
+  // edits in sequence, each relative to the tree after the previous one,
+  // then a single reparse
+  void edit(const std::vector<TSInputEdit> &edits, const std::string_view source);
+  void edit(const std::vector<TSInputEdit> &edits, SharedText source);
+  // reparses straight from the pieces, nothing is flattened
+  void edit(const TSInputEdit edit, const PieceTable &source);
+  void edit(const std::vector<TSInputEdit> &edits, const PieceTable &source);
 
+  // deferred edits only shift the tree with ts_tree_edit, the incremental
+  // reparse for all of them runs once when the tree is next read.
+  // turning it off flushes
+  void setDeferred(bool on);
+  bool isDeferred() const { return deferEdits; }
+  size_t pending() const { return pendingEdits; }
+  void flush() { if (pendingEdits != 0) reparse(); }
+
+  // O(1), the root knows whether any node below it is an error
+  bool hasErrors();
+  // ERROR and MISSING nodes, only subtrees holding an error are walked
   std::vector<TSRange> getErrors();
+  // errors intersecting the given ranges, each reported once
+  std::vector<TSRange> getErrors(const std::vector<TSRange> &within);
+
+  // edited ranges plus ts_tree_get_changed_ranges of every reparse since the
+  // last clearChanges(), sorted and merged. flushes pending edits
+  std::vector<TSRange> changedRanges();
+  void clearChanges() { changed.clear(); }
 
   // Returns a non-owning pointer to the underlying TSTree.
   // Use ts_tree_copy() if you need an independent lifetime.
-  TSTree *getRawTree() const { return tree.get(); }
+  TSTree *getRawTree() { flush(); return tree.get(); }
 
   TSEngine* getParent() const { return parent; }
-  std::string_view getSource() {return source; }
+  std::string_view getSource(); // flattens once when parsed from pieces
+  size_t sourceSize() const { return fromPieces ? pieces.size() : source.size(); }
+  bool isInjected() const { return injected; }
+  // a reparse ran out of time or was cancelled, the edited ranges are not
+  // parsed until a later reparse finishes
+  bool isStale() const { return stale; }
+  const std::string &getOrigin() const { return origin; }
   
   void sync();
 };
 
+// A guest language parsed only inside ranges of a host tree, HQL in Java
+// string literals or SQL in hbm.xml CDATA. Nodes keep host offsets and the
+// trees share the host text, so captures line up with the host and with
+// FileEditor edits, and nothing outside the ranges is parsed.
+// Each range is its own tree unless combined, trees are in document order.
+class InjectedLayer {
+  std::vector<CSTTree> trees;
+  TSEngine *guest = nullptr;
+
+public:
+  InjectedLayer() = default;
+  InjectedLayer(std::vector<CSTTree> trees, TSEngine *guest)
+      : trees(std::move(trees)), guest(guest) {}
+
+  template <typename cb> 
+  void find(TSQuery *query, const QueryPredicates &predicates, cb handle) {
+      for (auto &t : trees) {
+        t.find(query, predicates, handle);
+      }
+  }
+
+  // handle(tree, match), the guest tree the match's nodes belong to
+  template <typename cb> 
+  void findWithTree(TSQuery *query, const QueryPredicates &predicates, cb handle) {
+      for (auto &t : trees) {
+        t.find(query, predicates, [&t, &handle](TSQueryMatch match) { handle(t, match); });
+      }
+  }
+
+  bool hasErrors();
+  std::vector<TSRange> getErrors();
+
+  size_t size() const { return trees.size(); }
+  CSTTree &at(size_t i) { return trees.at(i); }
+  TSEngine *getParent() const { return guest; }
+};
+
+
+
+// thrown by TSEngine::parse when the time budget ran out or the run was
+// cancelled, the parser is reset and can be used again
+class ParseAborted : public std::runtime_error {
+public:
+  const bool timedOut;
+  ParseAborted(const std::string &what, bool timedOut)
+      : std::runtime_error(what), timedOut(timedOut) {}
+};
+
+struct ParseStats {
+  size_t timedOut = 0;
+  size_t cancelled = 0;
+  std::vector<std::string> files; // what was being parsed, for the run summary
+};
+
+// Time budget and cancellation for every parse of every engine, so one huge
+// or malformed file cannot hold a pool worker. A walk that aborts only
+// cancels the parses of its own jobs, see Scope. cancel() stops every parse
+// until reset(), which the run does when it ends.
+class ParseControl {
+  std::atomic<uint64_t> budgetMicros{30ull * 1000 * 1000};
+  std::atomic<bool> cancelled{false};
+  mutable std::mutex mtx;
+  ParseStats aborted;
 
+public:
+  static ParseControl &global() {
+    static ParseControl instance;
+    return instance;
+  }
+
+  // per parse, 0 for no limit
+  void setBudget(uint64_t micros) { budgetMicros = micros; }
+  uint64_t budget() const { return budgetMicros.load(); }
+
+  void cancel() { cancelled = true; }
+  // cancel() or the signal of the Scope this thread is in
+  bool isCancelled() const;
+
+  // parses on this thread also stop once signal is set, a pooled walk holds
+  // one around each job with its abort signal. Scopes nest
+  class Scope {
+    const std::atomic<bool> *previous;
+
+  public:
+    explicit Scope(const std::atomic<bool> *signal);
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+    ~Scope();
+  };
+
+  void recordAborted(const std::string &what, bool timedOut);
+  ParseStats stats() const;
+  void reset(); // clears the cancel flag and the stats
+};
 
 class TSEngine {
   const TSLanguage *lang;
   TSParser *parser;
 
+  // ts_parser_parse_with_options under ParseControl, what names the input
+  // in the run summary. throws ParseAborted
+  TSTree *parseInput(const TSTree *old, TSInput input, const std::string &what);
+  // parseInput limited to ranges, the parser reads everything again after
+  TSTree *parseWithin(const TSTree *old, TSInput input, const std::vector<TSRange> &ranges,
+                      const std::string &what);
+
 public:
   TSEngine(const TSLanguage *lang);
+  // owns the parser and trees keep a pointer to it
+  TSEngine(const TSEngine&) = delete;
+  TSEngine& operator=(const TSEngine&) = delete;
   ~TSEngine();
-  CSTTree parse(std::string_view source);
+  // source must outlive the tree, what names it when the parse is aborted
+  CSTTree parse(std::string_view source, const std::string &what = "");
+  CSTTree parse(SharedText source);       // the tree shares the text
   CSTTree parse(const CSTTree &old, std::string_view modSource);
+  CSTTree parse(const CSTTree &old, const PieceTable &modSource);
   CSTTree parse(FileReader &reader);
-  CSTTree parse(FileWriter &writer);
+  CSTTree parse(FileWriter &writer); // reads the pieces through TSInput, no copy
+  CSTTree parse(const PieceTable &source, const std::string &what = "");
+
+  // this engine's language over only ranges of host's text, sorted and not
+  // overlapping. The tree shares host's text and keeps host offsets
+  CSTTree parseIncluded(const CSTTree &host, const std::vector<TSRange> &ranges);
+  // every range on its own, or all of them as one document when combined
+  InjectedLayer inject(const CSTTree &host, std::vector<TSRange> ranges, bool combined = false);
 
   static TSRange getRange(TSNode n);
 
@@ -1,19 +1,84 @@
 #include <CacheAndPool.hpp>
+#include <FileReaderWriter.hpp>
 #include <Logger.hpp>
 #include <functional>
+#include <fstream>
+#include <filesystem>
+#include <cstring>
+#include <cstdlib>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
 
 namespace copypasta {
+    // CacheEpoch
+    namespace {
+        std::mutex& recordsMutex() {
+            static std::mutex mtx;
+            return mtx;
+        }
+    }
+
+    std::atomic<uint64_t> CacheEpoch::current{ 1 };
+
+    // records of exited threads are dropped by oldestOnline()
+    std::vector<std::shared_ptr<CacheEpoch::Record>>& CacheEpoch::records() {
+        static std::vector<std::shared_ptr<Record>> all;
+        return all;
+    }
+
+    CacheEpoch::Holder::Holder() : record(std::make_shared<Record>()) {
+        std::lock_guard<std::mutex> lock(recordsMutex());
+        records().push_back(record);
+    }
+
+    uint64_t CacheEpoch::oldestOnline() {
+        uint64_t oldest = current.load();
+        std::lock_guard<std::mutex> lock(recordsMutex());
+        auto& all = records();
+        all.erase(std::remove_if(all.begin(), all.end(),
+            [](const std::shared_ptr<Record>& r) { return r.use_count() == 1; }), all.end());
+        for (auto& r : all) {
+            uint64_t online = r->online.load();
+            if (online != 0 && online < oldest)
+                oldest = online;
+        }
+        return oldest;
+    }
+
     // PcreCache 
+    void PcreCache::jit(Entry& entry) {
+        std::call_once(entry.jit, [&entry]() {
+            DEBUG_FULL("PcreCache jit compile");
+            // partial hard is used when streaming blocks in FileReader::findEachWith
+            pcre2_jit_compile(entry.re, PCRE2_JIT_COMPLETE | PCRE2_JIT_PARTIAL_HARD);
+            });
+    }
+
+    size_t PcreCache::sizeOf(const Entry& entry) {
+        size_t size = 0;
+        pcre2_pattern_info(entry.re, PCRE2_INFO_SIZE, &size);
+        return size; // JIT code is not counted, it is added lazily
+    }
+
+    PcreCache::Stats PcreCache::stats() const {
+        return cache.stats();
+    }
+
     pcre2_code* PcreCache::get(const std::string& pattern, uint32_t opt_compile) {
+        return get(pattern, opt_compile, hashPattern(pattern));
+    }
+
+    pcre2_code* PcreCache::get(const std::string& pattern, uint32_t opt_compile, size_t patternHash) {
         Key k{ pattern, opt_compile };
-        {
-            DEBUG_FULL("PcreCache lock mtx");
-            std::lock_guard<std::mutex> lock(mtx);
-            auto it = cache.find(k);
-            if (it != cache.end()) {
-                DEBUG_FULL("PcreCache found from cache");
-                return it->second;
-            }
+        size_t hash = hashKey(patternHash, opt_compile);
+        if (Entry* hit = cache.find(k, hash)) {
+            DEBUG_FULL("PcreCache found from cache");
+            jit(*hit); // no-op unless restored from disk
+            return hit->re;
         }
 
         DEBUG_FULL("PcreCache compile pattern - " << pattern);
@@ -44,11 +109,250 @@ namespace copypasta {
             LERROR(msg);
             throw std::invalid_argument(msg);
         }
-        pcre2_jit_compile(re, PCRE2_JIT_COMPLETE);
         DEBUG_FULL("PcreCache compile pattern done - " << pattern);
-        std::lock_guard<std::mutex> lock(mtx);
-        auto [it, _] = cache.emplace(k, re);
-        return it->second;
+
+        auto fresh = std::make_unique<Entry>();
+        fresh->re = re;
+        size_t bytes = sizeOf(*fresh);
+        // if another thread compiled it first ours is freed here
+        auto [entry, inserted] = cache.insert(k, hash, std::move(fresh), bytes);
+        if (inserted)
+            dirty = true;
+        jit(*entry);
+        return entry->re;
+    }
+
+    namespace {
+        constexpr char PCRE_CACHE_MAGIC[8] = { 'c','p','P','c','r','e','2','\0' };
+
+        std::string pcreVersion() {
+            int len = pcre2_config(PCRE2_CONFIG_VERSION, NULL);
+            std::string version(len > 0 ? len : 0, '\0');
+            if (len > 0) {
+                pcre2_config(PCRE2_CONFIG_VERSION, version.data());
+                version.resize(len - 1); // drop the terminator
+            }
+            return version;
+        }
+
+        template <typename T> void writeRaw(std::ofstream& out, const T& v) {
+            out.write(reinterpret_cast<const char*>(&v), sizeof(T));
+        }
+
+        template <typename T> bool readRaw(std::ifstream& in, T& v) {
+            return (bool)in.read(reinterpret_cast<char*>(&v), sizeof(T));
+        }
+    }
+
+    // in the user's cache dir, pcre2 decodes serialized code without checking
+    // it, so a shared location would run whatever another user planted there
+    std::string PcreCache::defaultPersistPath() {
+        if (const char* env = std::getenv("COPYPASTA_PCRE_CACHE")) {
+            return env;
+        }
+        std::filesystem::path dir;
+        if (const char* xdg = std::getenv("XDG_CACHE_HOME"); xdg && *xdg)
+            dir = xdg;
+        else if (const char* home = std::getenv("HOME"); home && *home)
+            dir = std::filesystem::path(home) / ".cache";
+        else if (const char* local = std::getenv("LOCALAPPDATA"); local && *local)
+            dir = local;
+        else
+            return ""; // nowhere private, persistence disabled
+        return (dir / "copypasta" / "pcre2.cache").string();
+    }
+
+    // layout - magic, version, count, count x (opts, len, pattern), blob size, blob
+    bool PcreCache::save(const std::string& path) {
+        if (path.empty())
+            return false; // persistence disabled
+
+        if (!dirty.exchange(false)) {
+            DEBUG("PcreCache save skipped, nothing new");
+            return true;
+        }
+        // copies, entries may be evicted while writing
+        std::vector<pcre2_code*> codes;
+        std::vector<Key> keys;
+        cache.forEach([&](const Key& k, Entry& entry) {
+            keys.push_back(k);
+            codes.push_back(pcre2_code_copy(entry.re));
+            });
+        if (codes.empty())
+            return true;
+        struct FreeCodes {
+            std::vector<pcre2_code*>& codes;
+            ~FreeCodes() { for (auto re : codes) pcre2_code_free(re); }
+        } freeCodes{ codes };
+
+        uint8_t* blob = nullptr;
+        PCRE2_SIZE blobSize = 0;
+        int32_t rc = pcre2_serialize_encode(const_cast<const pcre2_code**>(codes.data()),
+            (int32_t)codes.size(), &blob, &blobSize, NULL);
+        if (rc < 0) {
+            PCRE2_UCHAR buf[256];
+            pcre2_get_error_message(rc, buf, sizeof(buf));
+            WARN("PcreCache save encode failed - " << buf);
+            dirty = true;
+            return false;
+        }
+
+        std::error_code ec;
+        auto dir = std::filesystem::path(path).parent_path();
+        if (!dir.empty() && !std::filesystem::exists(dir, ec)) {
+            std::filesystem::create_directories(dir, ec);
+            std::filesystem::permissions(dir, std::filesystem::perms::owner_all, ec);
+        }
+
+        // write aside and rename so a concurrent run never reads half a file,
+        // each run has its own temp file so two saves never mix
+        std::string tmpPath = FileWriter::tempPathFor(path);
+#if defined(__unix__) || defined(__APPLE__)
+        // readable and replaceable by this user only, load() trusts nothing else
+        int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if (fd >= 0)
+            ::close(fd);
+#endif
+        std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+        out.write(PCRE_CACHE_MAGIC, sizeof(PCRE_CACHE_MAGIC));
+        std::string version = pcreVersion();
+        writeRaw(out, (uint32_t)version.size());
+        out.write(version.data(), version.size());
+        writeRaw(out, (uint32_t)keys.size());
+        for (auto& k : keys) {
+            writeRaw(out, k.opts);
+            writeRaw(out, (uint32_t)k.pattern.size());
+            out.write(k.pattern.data(), k.pattern.size());
+        }
+        writeRaw(out, (uint64_t)blobSize);
+        out.write(reinterpret_cast<const char*>(blob), blobSize);
+        pcre2_serialize_free(blob);
+        out.close();
+
+        if (!out.good() || (std::filesystem::rename(tmpPath, path, ec), ec)) {
+            WARN("PcreCache save failed - " << path);
+            std::filesystem::remove(tmpPath, ec);
+            dirty = true;
+            return false;
+        }
+
+        INFO("PcreCache saved " << keys.size() << " patterns to " << path);
+        return true;
+    }
+
+    // a cache that cannot be used is skipped, the run compiles from scratch
+    size_t PcreCache::load(const std::string& path) {
+        if (path.empty())
+            return 0; // persistence disabled
+
+        try {
+            return loadFile(path);
+        }
+        catch (const std::exception& e) {
+            WARN("PcreCache load failed - " << path << " - " << e.what());
+            return 0;
+        }
+    }
+
+    size_t PcreCache::loadFile(const std::string& path) {
+#if defined(__unix__) || defined(__APPLE__)
+        struct stat st;
+        if (::lstat(path.c_str(), &st) != 0) {
+            DEBUG("PcreCache load nothing at " << path);
+            return 0;
+        }
+        if (!S_ISREG(st.st_mode) || st.st_uid != ::geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+            WARN("PcreCache load ignoring cache not private to this user - " << path);
+            return 0;
+        }
+#endif
+        std::ifstream in(path, std::ios::binary);
+        if (!in) {
+            DEBUG("PcreCache load nothing at " << path);
+            return 0;
+        }
+
+        // lengths come from the file, none may claim more than is left of it
+        std::error_code ec;
+        uint64_t size = std::filesystem::file_size(path, ec);
+        if (ec)
+            return 0;
+        auto left = [&in, size]() -> uint64_t {
+            auto at = in.tellg();
+            return at < 0 ? 0 : size - std::min<uint64_t>(size, (uint64_t)at);
+            };
+
+        char magic[sizeof(PCRE_CACHE_MAGIC)];
+        uint32_t len = 0;
+        if (!in.read(magic, sizeof(magic)) || std::memcmp(magic, PCRE_CACHE_MAGIC, sizeof(magic)) != 0
+            || !readRaw(in, len) || len > left()) {
+            WARN("PcreCache load not a cache file - " << path);
+            return 0;
+        }
+        std::string version(len, '\0');
+        if (!in.read(version.data(), len) || version != pcreVersion()) {
+            INFO("PcreCache load ignoring cache from pcre2 " << version);
+            return 0;
+        }
+
+        uint32_t count = 0;
+        if (!readRaw(in, count) || count > left() / (2 * sizeof(uint32_t)))
+            return 0;
+        std::vector<Key> keys(count);
+        for (auto& k : keys) {
+            uint32_t plen = 0;
+            if (!readRaw(in, k.opts) || !readRaw(in, plen) || plen > left())
+                return 0;
+            k.pattern.resize(plen);
+            if (!in.read(k.pattern.data(), plen))
+                return 0;
+        }
+
+        // the serialized header alone is four words
+        uint64_t blobSize = 0;
+        if (!readRaw(in, blobSize) || blobSize > left() || blobSize < 4 * sizeof(uint32_t)) {
+            WARN("PcreCache load truncated cache - " << path);
+            return 0;
+        }
+        std::vector<uint8_t> blob(blobSize);
+        if (!in.read(reinterpret_cast<char*>(blob.data()), blobSize)
+            || pcre2_serialize_get_number_of_codes(blob.data()) != (int32_t)count) {
+            WARN("PcreCache load truncated cache - " << path);
+            return 0;
+        }
+
+        std::vector<pcre2_code*> codes(count);
+        int32_t rc = pcre2_serialize_decode(codes.data(), (int32_t)count, blob.data(), NULL);
+        if (rc < 0) {
+            PCRE2_UCHAR buf[256];
+            pcre2_get_error_message(rc, buf, sizeof(buf));
+            WARN("PcreCache load decode failed - " << buf);
+            return 0;
+        }
+
+        size_t loaded = 0;
+        for (uint32_t i = 0; i < count; i++) {
+            auto entry = std::make_unique<Entry>();
+            entry->re = codes[i];
+            size_t bytes = sizeOf(*entry);
+            size_t hash = hashKey(hashPattern(keys[i].pattern), keys[i].opts);
+            if (cache.insert(keys[i], hash, std::move(entry), bytes).second)
+                loaded++;
+        }
+        INFO("PcreCache loaded " << loaded << " patterns from " << path);
+        return loaded;
+    }
+
+    // tasks look their pattern up again, it may be evicted before they run
+    void PcreCache::jitAll(ThreadPool& pool) {
+        std::vector<Key> keys;
+        cache.forEach([&keys](const Key& k, Entry&) { keys.push_back(k); });
+        for (auto& k : keys) {
+            pool.enqueue([this, k]() {
+                if (Entry* e = cache.find(k, hashKey(hashPattern(k.pattern), k.opts)))
+                    jit(*e);
+                });
+        }
     }
 
     //TSEnginePool (dont use with ThreadPool)
@@ -69,19 +373,57 @@ namespace copypasta {
 
     // TSQueryCache
     TSQuery* TSQueryCache::get(const TSEngine* engine, const std::string& pattern) {
+        return get(engine, pattern, hashPattern(pattern));
+    }
 
-        DEBUG_FULL("TSQueryCache get lock mtx");
-        std::lock_guard<std::mutex> lock(mtx);
-        auto key = std::make_pair(engine, pattern);
-        auto it = cache.find(key);
-        if (it != cache.end()) {
-            DEBUG_FULL("TSQueryCache found from cache");
-            return it->second;
+    TSQuery* TSQueryCache::get(const TSEngine* engine, const std::string& pattern, size_t patternHash) {
+        return entry(engine, pattern, patternHash).query;
+    }
+
+    const TSQueryCache::Entry& TSQueryCache::entry(const TSEngine* engine, const std::string& pattern) {
+        return entry(engine, pattern, hashPattern(pattern));
+    }
+
+    const TSQueryCache::Entry& TSQueryCache::entry(const TSEngine* engine, const std::string& pattern, size_t patternHash) {
+        Key k{ engine, pattern };
+        Entry* cached = cache.get(k, hashKey(engine, patternHash),
+            [&]() {
+                DEBUG_FULL("TSQueryCache compile query");
+                auto fresh = std::make_unique<Entry>();
+                fresh->query = engine->queryNew(const_cast<std::string&>(pattern));
+                fresh->predicates = QueryPredicates(fresh->query);
+                return fresh;
+            },
+            [&pattern](const Entry&) {
+                // tree-sitter does not report query memory, steps scale with the source
+                return 256 + pattern.size() * 32;
+            });
+        return *cached;
+    }
+
+    TSQueryCache::Combined TSQueryCache::combine(const TSEngine* engine, const std::vector<std::string>& patterns) {
+        std::string joined;
+        std::vector<uint32_t> starts;
+        for (auto& p : patterns) {
+            starts.push_back((uint32_t)joined.size());
+            joined += p;
+            joined += '\n';
         }
+        Combined res;
+        res.entry = &entry(engine, joined);
+        // patterns keep their source order, each belongs to the query its text starts in
+        uint32_t count = ts_query_pattern_count(res.entry->query);
+        res.owner.resize(count);
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t at = ts_query_start_byte_for_pattern(res.entry->query, i);
+            res.owner[i] = (uint32_t)(std::upper_bound(starts.begin(), starts.end(), at) - starts.begin() - 1);
+        }
+        DEBUG("TSQueryCache combine - " << patterns.size() << " queries, " << count << " patterns");
+        return res;
+    }
 
-        TSQuery* q = engine->queryNew(const_cast<std::string&>(pattern));
-        cache[key] = q;
-        return q;
+    TSQueryCache::Stats TSQueryCache::stats() const {
+        return cache.stats();
     }
 
 
@@ -114,6 +456,8 @@ namespace copypasta {
                     DEBUG("ThreadPool worker do job");
                     job(); // Execute the action
                     DEBUG("ThreadPool worker job done");
+                    // a finished job holds nothing from the caches, see CacheEpoch
+                    CacheEpoch::offline();
                     if (activeTasks.fetch_sub(1) == 1) {
                         DEBUG("ThreadPool worker all jobs done");
                         // this was the last job
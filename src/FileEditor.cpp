@@ -1,10 +1,89 @@
 #include <FileEditor.hpp>
+#include <CacheAndPool.hpp>
 #include <Logger.hpp>
 #include <assert.h>
 #include <algorithm>
 
 namespace copypasta {
 
+    namespace {
+        // modifying edits sorted by start with a running max of their ends,
+        // a lookup walks back from the last edit starting before the range
+        // ends and stops once no earlier edit reaches the range
+        class EditIndex {
+            using OP = FileEditor::OP;
+            struct Span {
+                uint32_t from;
+                uint32_t to;
+                size_t op; // index in operations
+            };
+            std::vector<Span> spans;
+            std::vector<uint32_t> maxTo;
+
+        public:
+            explicit EditIndex(const std::vector<FileEditor::Edit>& ops) {
+                for (size_t i = 0; i < ops.size(); i++) {
+                    auto op = ops[i].op;
+                    if (NOT_CONFLICTING_OP(op) || op == FileEditor::OP_VALIDATE_CST)
+                        continue;
+                    spans.push_back({ ops[i].range.start_byte, ops[i].range.end_byte, i });
+                }
+                std::sort(spans.begin(), spans.end(), [](const Span& a, const Span& b) {
+                    return a.from < b.from;
+                    });
+                maxTo.reserve(spans.size());
+                for (auto& sp : spans) {
+                    maxTo.push_back(maxTo.empty() ? sp.to : std::max(maxTo.back(), sp.to));
+                }
+            }
+
+            // the first edit in operations order overlapping r, npos if none
+            size_t find(const TSRange& r) const {
+                auto it = std::upper_bound(spans.begin(), spans.end(), r.end_byte,
+                    [](uint32_t at, const Span& sp) { return at < sp.from; });
+                size_t found = std::string::npos;
+                for (size_t i = it - spans.begin(); i > 0 && maxTo[i - 1] >= r.start_byte; i--) {
+                    const Span& sp = spans[i - 1];
+                    if (sp.to >= r.start_byte && (found == std::string::npos || sp.op < found))
+                        found = sp.op;
+                }
+                return found;
+            }
+        };
+
+        // defers the tree's reparses for one apply, the previous mode comes
+        // back on return and when a step throws
+        class DeferredMode {
+            CSTTree& tree;
+            bool was;
+            bool restored = false;
+
+        public:
+            explicit DeferredMode(CSTTree& tree) : tree(tree), was(tree.isDeferred()) {
+                tree.setDeferred(true);
+            }
+            DeferredMode(const DeferredMode&) = delete;
+            DeferredMode& operator=(const DeferredMode&) = delete;
+
+            // flushes pending edits when the tree was not deferred before
+            void restore() {
+                restored = true;
+                tree.setDeferred(was);
+            }
+
+            ~DeferredMode() {
+                if (restored)
+                    return;
+                try {
+                    tree.setDeferred(was);
+                }
+                catch (const std::exception& e) {
+                    LERROR("FileEditor unable to restore tree - " << e.what());
+                }
+            }
+        };
+    }
+
     FileEditor::FileEditor() {
 
 #define GENERATE_MAP(ENUM) OP_STR[ENUM] = #ENUM;
@@ -15,17 +94,8 @@ namespace copypasta {
 #undef GENERATE_MAP
     };
 
-    /*
-    ReaderWriterEditorEngineTree getReaderWriterEngineTree(const File& file, const TSLanguage* lang){
-       // TODO: these should have move ctor, otherwise they are copied on return
-       FileReader fr(file);
-       FileWriter fw(fr.snapshot());
-       FileEditor edt;
-       TSEngine eng(lang);
-       CSTTree t = eng.parse(fw);
-       return {fr, fw, edt, eng, t};
-    }
-    */
+    // reader, writer and tree move, but the tree points at its engine and
+    // TSEngine is pinned, so the bundle is declared in place instead of returned
 #define ReaderWriterEngineTree(file,lang)            \
                      FileReader fr(file);            \
                      FileWriter fw(fr.snapshot());   \
@@ -166,7 +236,7 @@ namespace copypasta {
             te.old_end_byte = edit.range.start_byte;
             te.new_end_byte = edit.range.start_byte + (uint32_t)edit.change.length();
             writer.insert(edit.range.start_byte, edit.change);
-            tree.edit(te, writer.snapshot().cont);
+            tree.edit(te, writer.content());
             break;
         }
         case OP_INSERT_ROW_BEFORE:
@@ -187,7 +257,7 @@ namespace copypasta {
             te.old_end_point = { edit.range.start_point.row, 0 };
             te.new_end_point = { edit.range.start_point.row + 1, 0 };
 
-            tree.edit(te, writer.snapshot().cont);
+            tree.edit(te, writer.content());
             break;
         }
         case OP_INSERT_ROW_AFTER:
@@ -208,14 +278,14 @@ namespace copypasta {
             te.old_end_point = { edit.range.end_point.row + 1  , 0 };
             te.new_end_point = { edit.range.end_point.row + 1 + 1, 0 };
 
-            tree.edit(te, writer.snapshot().cont);
+            tree.edit(te, writer.content());
             break;
         }
         case OP_DELETE:
         {
             te.old_end_byte = edit.range.end_byte;
             writer.deleteCont(edit.range.start_byte, edit.range.end_byte);
-            tree.edit(te, writer.snapshot().cont);
+            tree.edit(te, writer.content());
             break;
         }
         case OP_WRITE:
@@ -223,13 +293,43 @@ namespace copypasta {
             te.old_end_byte = edit.range.end_byte;
             te.new_end_byte = edit.range.start_byte + (uint32_t)edit.change.length();
             writer.write(edit.range.start_byte, edit.range.end_byte, edit.change);
-            tree.edit(te, writer.snapshot().cont);
+            tree.edit(te, writer.content());
             break;
         }
         case OP_REPLACE:
         {
-            writer.replaceAll(edit.change, edit.context);
-            tree.sync(); // substitutions may occur anywhere
+            std::vector<size_t> oldRows = writer.getRowOffsets();
+            pcre2_code* re = PcreCache::global().get(edit.change, 0);
+            OffsetMap moved = writer.substituteAll(re, edit.context);
+            if (moved.entries.empty())
+                break;
+
+            // only the replaced ranges are reparsed, bottom to top in old coordinates
+            std::vector<TSInputEdit> treeEdits;
+            treeEdits.reserve(moved.entries.size());
+            for (auto it = moved.entries.rbegin(); it != moved.entries.rend(); ++it) {
+                TSInputEdit ed{};
+                ed.start_byte = (uint32_t)it->oldFrom;
+                ed.old_end_byte = (uint32_t)it->oldTo;
+                ed.new_end_byte = (uint32_t)(it->oldFrom + (it->newTo - it->newFrom));
+                ed.start_point = _getP(it->oldFrom, oldRows);
+                ed.old_end_point = _getP(it->oldTo, oldRows);
+                ed.new_end_point = ed.start_point;
+                writer.content().forEachChunk(it->newFrom, it->newTo, [&ed](std::string_view chunk) {
+                    for (char c : chunk) {
+                        if (c == '\n') {
+                            ed.new_end_point.row++;
+                            ed.new_end_point.column = 0;
+                        }
+                        else {
+                            ed.new_end_point.column++;
+                        }
+                    }
+                    return true;
+                    });
+                treeEdits.push_back(ed);
+            }
+            tree.edit(treeEdits, writer.content());
             break;
         }
         case OP_MARK:
@@ -278,27 +378,32 @@ namespace copypasta {
                 te1.new_end_point.row = op.row + 1;
                 te1.new_end_point.column = 0;
 
-                tree.edit(te1, writer.snapshot().cont);
+                tree.edit(te1, writer.content());
             }
 
             break;
         }
         case OP_VALIDATE_CST: {
-            for (auto& err : tree.getErrors()) {
-                // Find the modifying edit whose range overlaps this CST error
-                Edit causingEdit = edit; // fallback to the validate edit itself
-                for (auto& op : operations) {
-                    if (NOT_CONFLICTING_OP(op.op)
-                        || (op.op == OP::OP_VALIDATE_CST)) continue;
-
-                    bool overlaps = op.range.start_byte <= err.end_byte &&
-                        op.range.end_byte >= err.start_byte;
-                    if (overlaps) {
-                        causingEdit = op;
-                        break;
-                    }
+            bool hasErrors = tree.hasErrors();
+            if (tree.isStale()) {
+                // the reparse ran out of time, nothing the edits touched can be checked
+                EditIndex index(operations);
+                for (auto& r : tree.changedRanges()) {
+                    size_t cause = index.find(r);
+                    errors.push_back({ CST_UNPARSED, r, cause == std::string::npos ? edit : operations[cause] });
                 }
-                errors.push_back({ CST_ERROR, err, causingEdit });
+                break;
+            }
+            if (!hasErrors)
+                break;
+            // only what changed since apply started can hold new errors
+            auto changed = tree.changedRanges();
+            EditIndex index(operations);
+            for (auto& err : tree.getErrors(changed)) {
+                // the modifying edit whose range overlaps this CST error,
+                // the validate edit itself when none does
+                size_t cause = index.find(err);
+                errors.push_back({ CST_ERROR, err, cause == std::string::npos ? edit : operations[cause] });
             }
             break;
         }
@@ -418,6 +523,15 @@ namespace copypasta {
                         << "\"\n");
                     break;
                 }
+                case CST_UNPARSED:
+                {
+                    LERROR("CST_UNPARSED (edit - " << err.edit.id << ") :");
+                    LERROR("  Range: ["
+                        << err.range.start_point.row + 1 << ":" << err.range.start_point.column
+                        << " , "
+                        << err.range.end_point.row + 1 << ":" << err.range.end_point.column << "]");
+                    break;
+                }
                 default:
                     assert(0 && "NOT_IMPLEMENTED");
                 }
@@ -426,14 +540,18 @@ namespace copypasta {
         }
         case OP_SAVE_VALID_ONLY:
         {
-            if (writer.snapshot().dirty && errors.empty()) {
+            // errors the edits did not touch were already in the file
+            bool valid = errors.empty()
+                && (!tree.hasErrors() || tree.getErrors(tree.changedRanges()).empty())
+                && !tree.isStale();
+            if (writer.isDirty() && valid) {
                 writer.save();
             }
             break;
         }
         case OP_SAVE:
         {
-            if (writer.snapshot().dirty) {
+            if (writer.isDirty()) {
                 writer.save();
             }
             break;
@@ -493,6 +611,7 @@ namespace copypasta {
                 case CONFLICT:    errorTag = "//ERROR: CONFLICT"; break;
                 case CST_ERROR:   errorTag = "//ERROR: CST_ERROR"; break;
                 case CST_MISSING: errorTag = "//ERROR: CST_MISSING"; break;
+                case CST_UNPARSED: errorTag = "//ERROR: CST_UNPARSED"; break;
                 default:          errorTag = "//ERROR: UNKNOWN"; break;
                 }
 
@@ -516,6 +635,86 @@ namespace copypasta {
         }
         return errs;
     }
+    // all write/insert/delete ops in one FileWriter::applyBatch, so every range
+    // refers to the content before apply and the tree is reparsed once. The
+    // row ops run after it, their rows are moved to where the batch put them
+    OffsetMap FileEditor::applyByteRangeEdits(CSTTree& tree, FileWriter& writer) {
+        std::vector<int> conflicting;
+        for (auto& err : errors) {
+            if (err.e == CONFLICT)
+                conflicting.push_back(err.edit.id);
+        }
+
+        std::vector<TextEdit> batch;
+        std::vector<TSInputEdit> treeEdits;
+        for (auto& edit : operations) {
+            if (!isByteRangeOp(edit.op))
+                continue;
+            if (std::find(conflicting.begin(), conflicting.end(), edit.id) != conflicting.end()) {
+                WARN("FileEditor skipping conflicting edit - " << edit.id);
+                continue;
+            }
+
+            size_t from = edit.range.start_byte;
+            size_t to = edit.op == OP_INSERT ? from : edit.range.end_byte;
+            std::string text = edit.op == OP_DELETE ? "" : edit.change;
+
+            TSInputEdit te = {
+                  (uint32_t)from,                      // start_byte
+                  (uint32_t)to,                        // old_end_byte
+                  (uint32_t)(from + text.length()),    // new_end_byte
+                  edit.range.start_point,              // start_point
+                  edit.op == OP_INSERT ? edit.range.start_point : edit.range.end_point, // old_end_point
+                  getNewEndPoint(edit),                // new_end_point
+            };
+            treeEdits.push_back(te);
+            batch.push_back({ from, to, std::move(text) });
+        }
+
+        if (batch.empty())
+            return {};
+
+        bool rowOps = std::any_of(operations.begin(), operations.end(),
+            [](const Edit& edit) { return isRowOp(edit.op); });
+        std::vector<size_t> oldRows;
+        size_t oldSize = writer.size();
+        if (rowOps)
+            oldRows = writer.getRowOffsets();
+
+        // bottom to top so each tree edit is still in original coordinates
+        std::sort(treeEdits.begin(), treeEdits.end(),
+            [](const TSInputEdit& a, const TSInputEdit& b) {
+                if (a.start_byte != b.start_byte)
+                    return a.start_byte > b.start_byte;
+                return a.old_end_byte > b.old_end_byte;
+            });
+        OffsetMap moved = writer.applyBatch(std::move(batch));
+        tree.edit(treeEdits, writer.content());
+        if (!rowOps)
+            return moved;
+
+        // a start row follows its first byte, an end row its last one
+        const std::vector<size_t>& newRows = writer.getRowOffsets();
+        auto rowAt = [&newRows](size_t offset) {
+            return (uint32_t)(std::upper_bound(newRows.begin(), newRows.end(), offset) - newRows.begin() - 1);
+            };
+        for (auto& edit : operations) {
+            if (!isRowOp(edit.op))
+                continue;
+            size_t start = edit.range.start_point.row;
+            size_t end = edit.range.end_point.row;
+            if (start < oldRows.size())
+                edit.range.start_point.row = rowAt(moved.map(oldRows[start]));
+            if (end < oldRows.size()) {
+                size_t last = end + 1 < oldRows.size() ? oldRows[end + 1] - 1 : oldSize;
+                edit.range.end_point.row = rowAt(moved.map(last));
+            }
+            edit.range.start_byte = (uint32_t)moved.map(edit.range.start_byte);
+            edit.range.end_byte = (uint32_t)moved.map(edit.range.end_byte);
+        }
+        return moved;
+    }
+
     std::vector<FileEditor::Error> FileEditor::apply(CSTTree& tree, FileWriter& writer) {
 
         DEBUG("FileEditor apply begins");
@@ -524,12 +723,33 @@ namespace copypasta {
 
         sortOperations();
 
+        // row inserts, marks and replaces each edit the tree, they are all
+        // reparsed together the first time a step reads it or on return
+        DeferredMode deferred(tree);
+        tree.clearChanges();
+
+        // the batch runs before the first op that changes content, whatever is
+        // queued, so REPLACE and the row ops always see the written text
+        bool batched = false;
         for (size_t i = 0; i < operations.size(); i++) {
             DEBUG("FileEditor apply op - " << operations[i].id);
+            OP op = operations[i].op;
+            if (!batched && op != OP_BACKUP && op != OP_PRINT_CHANGE_BEFORE) {
+                applyByteRangeEdits(tree, writer);
+                batched = true;
+            }
+            if (isByteRangeOp(op)) {
+                currStep++;
+                continue;
+            }
             step(tree, writer);
         }
 
-        DEBUG("FileEditor apply ends");
+        deferred.restore();
+        if (tree.isStale()) {
+            WARN("FileEditor apply reparse aborted, tree is stale - " << writer.getFile().pathStr);
+        }
+        DEBUG("FileEditor apply ends - tree edits pending " << tree.pending());
         return errors;
     };
 
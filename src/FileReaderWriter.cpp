@@ -4,9 +4,106 @@
 #include <iostream>
 #include <assert.h>
 #include <algorithm>
+#include <cstring>
+#include <condition_variable>
+#include <exception>
+#include <atomic>
+#include <cerrno>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#elif defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 namespace copypasta {
 
+    // ContentClassifier
+
+    const char* ContentClassifier::name(KIND kind) {
+        switch (kind) {
+        case TEXT: return "text";
+        case BINARY: return "binary";
+        case GENERATED: return "generated";
+        case MINIFIED: return "minified";
+        default: return "unknown";
+        }
+    }
+
+    ContentClassifier::KIND ContentClassifier::classify(std::string_view sample) const {
+        sample = sample.substr(0, sampleSize);
+        if (sample.empty())
+            return TEXT;
+
+        if (std::memchr(sample.data(), '\0', sample.size()) != nullptr)
+            return BINARY;
+
+        // a sequence cut by the end of the sample is not counted as broken
+        size_t invalid = 0;
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(sample.data());
+        size_t n = sample.size();
+        for (size_t i = 0; i < n;) {
+            unsigned char c = p[i];
+            if (c < 0x80) {
+                i++;
+                continue;
+            }
+            size_t len = (c & 0xE0) == 0xC0 ? 2 : (c & 0xF0) == 0xE0 ? 3 : (c & 0xF8) == 0xF0 ? 4 : 0;
+            if (len == 0 || c == 0xC0 || c == 0xC1 || c > 0xF4) {
+                invalid++;
+                i++;
+                continue;
+            }
+            size_t j = 1;
+            while (j < len && i + j < n && (p[i + j] & 0xC0) == 0x80)
+                j++;
+            if (j < len && i + j < n) {
+                invalid += j;
+            }
+            i += j;
+        }
+        if (invalid > n * maxInvalidUtf8)
+            return BINARY;
+
+        size_t lines = 0;
+        size_t longest = 0;
+        size_t headerEnd = n;
+        for (size_t start = 0; start < n;) {
+            auto nl = static_cast<const char*>(std::memchr(sample.data() + start, '\n', n - start));
+            size_t end = nl ? nl - sample.data() : n;
+            longest = std::max(longest, end - start);
+            if (++lines == markerLines)
+                headerEnd = end;
+            start = end + 1;
+        }
+
+        std::string_view header = sample.substr(0, headerEnd);
+        for (auto& marker : generatedMarkers) {
+            if (!marker.empty() && header.find(marker) != std::string_view::npos)
+                return GENERATED;
+        }
+
+        if (longest > maxLineLength)
+            return MINIFIED;
+        if (lines >= 4 && n / lines > maxAvgLineLength)
+            return MINIFIED;
+        return TEXT;
+    }
+
+    ContentClassifier::KIND ContentClassifier::classify(const std::string& path) const {
+        std::ifstream in(path, std::ios::in | std::ios::binary);
+        if (!in.good())
+            return UNKNOWN;
+        std::string sample(sampleSize, '\0');
+        in.read(sample.data(), sampleSize);
+        sample.resize(in.gcount());
+        return classify(std::string_view(sample));
+    }
+
     void File::loadFromEntry() {
         if (dir_entry.exists()) {
             DEBUG_FULL("File loadFromEntry");
@@ -88,30 +185,35 @@ namespace copypasta {
 
     // FileReader
 
-#define UPDATE_ROW_OFFSETS(data, len)                                            \
-  if(!rowOffsetsValid){                                                          \
-    DEBUG_FULL("Updating row offsets - " << len);                                \
-    rowOffsets.clear();                                                          \
-    rowOffsets.push_back(0);                                                     \
-    for (size_t i = 0; i < (len); ++i) {                                         \
-      if ((data)[i] == '\n') {                                                   \
-        rowOffsets.push_back(i + 1);                                             \
-      }                                                                          \
-    }                                                                            \
-    rowOffsetsValid = true;                                                      \
-  }
-
     const std::vector<size_t>& FileReader::getRowOffsets() {
-        UPDATE_ROW_OFFSETS(buf, bufSize);
+        loadFirstBlock();
+        // buf only grows while streaming, so only the newly loaded tail is scanned
+        if (!rowOffsetsValid) {
+            rowOffsets.clear();
+            rowOffsets.push_back(0);
+            rowOffsetsEnd = 0;
+            rowOffsetsValid = true;
+        }
+        const char* data = buf.data();
+        while (rowOffsetsEnd < bufSize) {
+            auto nl = static_cast<const char*>(
+                std::memchr(data + rowOffsetsEnd, '\n', bufSize - rowOffsetsEnd));
+            if (nl == nullptr) {
+                rowOffsetsEnd = bufSize;
+                break;
+            }
+            rowOffsetsEnd = nl - data + 1;
+            rowOffsets.push_back(rowOffsetsEnd);
+        }
         return rowOffsets;
     }
 
     FileReader::FileReader(File file, size_t blockSize) {
         DEBUG_FULL("FileReader ctor");
-        this->file = file;
-        if (file.isValid) {
+        this->file = std::move(file);
+        if (this->file.isValid) {
             this->blockSize = blockSize;
-            _isValid = !file.isDir;
+            _isValid = !this->file.isDir;
             readFileMetadata();
         }
     };
@@ -129,8 +231,7 @@ namespace copypasta {
     FileReader::FileReader(const FileSnapshot snap, size_t blockSize) {
         DEBUG_FULL("FileReader ctor with snap");
         snapshotMode = true;
-        buf.reserve(snap.cont.length());
-        buf.assign(snap.cont.begin(), snap.cont.end());
+        buf = snap.cont;
         bufStart = 0;
         bufSize = snap.cont.length();
         file = snap.file;
@@ -141,31 +242,64 @@ namespace copypasta {
 
     FileReader::FileReader(const FileReader& copy) {
         DEBUG_FULL("FileReader copy");
+        *this = copy;
+    }
+
+    FileReader::FileReader(FileReader&& other) noexcept {
+        DEBUG_FULL("FileReader move");
+        *this = std::move(other);
+    }
+
+    FileReader& FileReader::operator=(const FileReader& copy) {
+        if (this == &copy)
+            return *this;
         file = copy.file;
         _isValid = copy._isValid;
         pos = copy.pos;
-        buf = copy.buf;
-        blockSize = copy.blockSize;
-        level = copy.level;
+        buf = copy.buf; // shared, copied on the next load into either reader
+        rowOffsetsValid = copy.rowOffsetsValid;
+        rowOffsetsEnd = copy.rowOffsetsEnd;
         rowOffsets = copy.rowOffsets;
+        level = copy.level;
         bufStart = copy.bufStart;
         bufSize = copy.bufSize;
+        blockSize = copy.blockSize;
+        parallelChunkSize = copy.parallelChunkSize;
         readReverse = copy.readReverse;
         snapshotMode = copy.snapshotMode;
+        return *this;
+    }
+
+    FileReader& FileReader::operator=(FileReader&& other) noexcept {
+        if (this == &other)
+            return *this;
+        file = std::move(other.file);
+        _isValid = other._isValid;
+        pos = other.pos;
+        buf = std::move(other.buf);
+        rowOffsetsValid = other.rowOffsetsValid;
+        rowOffsetsEnd = other.rowOffsetsEnd;
+        rowOffsets = std::move(other.rowOffsets);
+        level = other.level;
+        bufStart = other.bufStart;
+        bufSize = other.bufSize;
+        blockSize = other.blockSize;
+        parallelChunkSize = other.parallelChunkSize;
+        readReverse = other.readReverse;
+        snapshotMode = other.snapshotMode;
+        // the moved from reader is left empty and invalid
+        other._isValid = false;
+        other.bufSize = 0;
+        other.rowOffsetsValid = false;
+        return *this;
     }
 
+    // construction only checks the metadata File already has, content is
+    // loaded by the first access
     void FileReader::readFileMetadata() {
         if (file.isValid && file.size != 0) {
-
             DEBUG_FULL("FileReader readFileMetadata");
-
             bufStart = 0;
-            rowOffsets.reserve(file.size / 50);
-
-            size_t blockSize = std::min(this->blockSize, file.size);
-            DEBUG_FULL("FileReader readFileMetadata block size - " << blockSize);
-
-            load(0, blockSize);
         }
         else {
             LERROR("FileReader readFileMetadata failed");
@@ -175,6 +309,12 @@ namespace copypasta {
         }
     };
 
+    void FileReader::loadFirstBlock() {
+        if (bufSize == 0 && !snapshotMode) {
+            loadUpTo(blockSize);
+        }
+    }
+
     FileReader::block FileReader::sync() {
         if (!_isValid)
             return { nullptr, 0 };
@@ -186,13 +326,28 @@ namespace copypasta {
 
         file.sync();
 
-        buf.clear();
+        buf = SharedText(); // snapshots keep the old content
         bufSize = 0;
         bufStart = 0;
+        rowOffsetsValid = false;
         return load(0, file.size);
     };
 
-    std::string_view FileReader::get() { return get(bufStart, bufSize); }
+    ContentClassifier::KIND FileReader::classify() {
+        if (file.kind != ContentClassifier::UNKNOWN || !_isValid)
+            return file.kind;
+        auto& classifier = ContentClassifier::global();
+        // only the sample is read, later accesses extend buf from there
+        size_t sampled = snapshotMode ? bufSize : loadUpTo(classifier.sampleSize);
+        file.kind = classifier.classify(std::string_view(buf.data(), std::min(sampled, bufSize)));
+        DEBUG("FileReader classify - " << ContentClassifier::name(file.kind) << " - " << file.pathStr);
+        return file.kind;
+    }
+
+    std::string_view FileReader::get() {
+        loadFirstBlock();
+        return get(bufStart, bufSize);
+    }
 
     std::string_view FileReader::get(size_t from, size_t to) {
         if (!_isValid)
@@ -214,7 +369,7 @@ namespace copypasta {
 
         DEBUG_FULL("FileReader getLine " << row);
 
-        UPDATE_ROW_OFFSETS(buf, bufSize);
+        getRowOffsets();
         // this has caused OOM due to unbounded access over the array :)
         if (row + 1 == rowOffsets.size()) {
             return get(rowOffsets[row], this->file.size);
@@ -256,12 +411,16 @@ namespace copypasta {
 
         DEBUG("FileReader load from - " << from << " to - " << to);
 
-        buf.resize(to);
+        if (to < bufSize) {
+            rowOffsetsValid = false;
+        }
+        std::string& raw = buf.mut();
+        raw.resize(to);
 
         std::ifstream iFileStream(file.path.c_str(), std::ios::binary | std::ios::ate);
 
         iFileStream.seekg(bufSize, std::ios::beg);
-        iFileStream.read(&buf.data()[from], to - bufSize);
+        iFileStream.read(&raw[from], to - bufSize);
         size_t bytesRead = iFileStream.gcount();
 
         iFileStream.close();
@@ -347,9 +506,8 @@ namespace copypasta {
     }
 
     TSPoint FileReader::getP(size_t byteOffset) {
-        UPDATE_ROW_OFFSETS(buf, bufSize);
         // :: is needed to scope it from outside
-        return copypasta::_getP(byteOffset, rowOffsets);
+        return copypasta::_getP(byteOffset, getRowOffsets());
     }
 
 
@@ -362,12 +520,34 @@ namespace copypasta {
         return r;
     }
 
-    std::vector<FileReader::MatchResult> FileReader::find(std::string pattern,
-        bool regex, uint32_t opt_compile) {
+    size_t FileReader::loadUpTo(size_t to) {
+        size_t fileEnd = snapshotMode ? bufSize : file.size;
+        to = std::min(to, fileEnd);
+        if (to > bufSize) {
+            // appends [bufSize, to) to buf, buf is always absolute from 0
+            load(bufSize, to);
+        }
+        return std::min(to, bufSize);
+    }
 
+    FileReader::MatchResult FileReader::toMatchResult(const MatchView& view) {
+        const auto& offsets = getRowOffsets();
+        MatchResult match;
+        match.match = _makeRange(view.start, view.end, offsets);
+        for (int i = 1; i < view.pairs; i++) {
+            PCRE2_SIZE start = view.ovector[2 * i];
+            PCRE2_SIZE end = view.ovector[2 * i + 1];
 
-        std::vector<MatchResult> matches;
+            if (start == PCRE2_UNSET || end == PCRE2_UNSET)
+                continue;
 
+            match.captures.push_back(_makeRange(start, end, offsets));
+        }
+        return match;
+    }
+
+    std::vector<FileReader::MatchResult> FileReader::find(std::string pattern,
+        bool regex, uint32_t opt_compile) {
 
         DEBUG("FileReader find called with - " + pattern);
         if (regex) {
@@ -375,30 +555,12 @@ namespace copypasta {
 
             return findWith(re);
         }
-        else {
-            STORE_ITER_INFO;
-            for (auto block = next(); block.cont && block.size != 0; block = next()) {
-                std::string_view searchSpace(block.cont, block.size);
-
-                size_t foundPos = 0;
-                size_t offset = 0;
-                while ((foundPos = searchSpace.find(pattern, offset)) !=
-                    std::string_view::npos) {
-
-                    size_t matchStart = foundPos;
-                    size_t matchEnd = matchStart + pattern.size();
-
-                    MatchResult match;
-                    match.match = _makeRange(matchStart, matchEnd, rowOffsets);
-                    matches.push_back(match);
 
-                    offset = matchEnd;
-                }
-            }
-            RESTORE_ITER_INFO;
-            DEBUG("FileReader find done for - " + pattern);
-            return matches;
-        }
+        MatchBuffer out;
+        findInto(out, pattern, regex, opt_compile);
+        resolve(out);
+        DEBUG("FileReader find done for - " + pattern);
+        return out.toMatchResults();
     };
 
     std::vector<FileReader::MatchResult> FileReader::findIn(const std::string& text,
@@ -419,84 +581,721 @@ namespace copypasta {
         uint32_t opt_match) {
 
         DEBUG("FileReader findWith");
-        std::vector<MatchResult> matches;
-        STORE_ITER_INFO;
-        for (auto block = next(); block.cont && block.size != 0; block = next()) {
+        MatchBuffer out;
+        findWithInto(out, re, opt_match);
+        resolve(out);
+
+        DEBUG("FileReader findWith done");
+        return out.toMatchResults();
+    };
 
-            PCRE2_SPTR subject = (PCRE2_SPTR)block.cont;
-            PCRE2_SIZE subject_length = block.size;
-            PCRE2_SIZE* ovector;
+    size_t FileReader::findInto(MatchBuffer& out, const std::string& pattern,
+        bool regex, uint32_t opt_compile) {
+        out.clear();
+        return findEach(pattern, [&out](const MatchView& view) {
+            out.push(view);
+            return true;
+            }, regex, opt_compile);
+    }
 
-            pcre2_match_data* match_data;
-            match_data = pcre2_match_data_create_from_pattern(re, NULL);
+    size_t FileReader::findWithInto(MatchBuffer& out, pcre2_code* re, uint32_t opt_match) {
+        out.clear();
+        return findEachWith(re, [&out](const MatchView& view) {
+            out.push(view);
+            return true;
+            }, opt_match);
+    }
 
-            int rc = 0;
-            PCRE2_SIZE startOffset = 0;
+    namespace {
+        struct SearchSpec {
+            std::string literal;
+            pcre2_code* re = nullptr; // literal search when null
+            uint32_t opt_match = 0;
+            size_t lookbehind = 0; // bytes before a start position the pattern may look at
+            bool utf = false;
+        };
+
+        // what a Window reads from, loaded when the reader already holds it all
+        struct Content {
+            std::string_view loaded;
+            std::string path;
+            size_t size = 0;
+        };
+
+        // the part of the content one search step looks at, a worker holds its
+        // chunk, the overlap and whatever partial matches asked for on top
+        class Window {
+            const Content& content;
+            std::string data;
+#if defined(__unix__) || defined(__APPLE__)
+            int fd = -1;
+#else
+            std::ifstream in;
+#endif
+
+            void read(size_t from, size_t to) {
+                data.resize(to - from);
+                size_t got = 0;
+#if defined(__unix__) || defined(__APPLE__)
+                if (fd < 0)
+                    fd = ::open(content.path.c_str(), O_RDONLY | O_CLOEXEC);
+                while (fd >= 0 && got < data.size()) {
+                    ssize_t n = ::pread(fd, &data[got], data.size() - got, from + got);
+                    if (n < 0 && errno == EINTR)
+                        continue;
+                    if (n <= 0)
+                        break;
+                    got += n;
+                }
+#else
+                if (!in.is_open())
+                    in.open(content.path, std::ios::in | std::ios::binary);
+                in.clear();
+                in.seekg(from);
+                in.read(data.data(), data.size());
+                got = in.gcount();
+#endif
+                if (got != data.size())
+                    throw std::runtime_error("FileReader read failed - " + content.path);
+            }
+
+        public:
+            size_t base = 0;
+            std::string_view view; // [base, base + view.size())
+
+            explicit Window(const Content& content) : content(content) {
+                if (content.loaded.size() >= content.size)
+                    view = content.loaded;
+            }
+            Window(const Window&) = delete;
+            Window& operator=(const Window&) = delete;
+            ~Window() {
+#if defined(__unix__) || defined(__APPLE__)
+                if (fd >= 0)
+                    ::close(fd);
+#endif
+            }
+
+            size_t end() const { return content.size; }
+
+            // [from, to) clipped to the end is in view afterwards, at least
+            // ahead bytes are read so a forward scan does not read per step
+            void cover(size_t from, size_t to, size_t ahead = 0) {
+                to = std::min(to, content.size);
+                if (from >= base && to <= base + view.size())
+                    return;
+                to = std::min(content.size, std::max(to, from + ahead));
+                read(from, std::max(from, to));
+                base = from;
+                view = data;
+            }
+        };
+
+        // leftmost match starting in [from, stop), the window starts lookbehind
+        // bytes early so lookbehind and \b see what the sequential search sees;
+        // it ends at stop + overlap and a partial hit there reads twice as far
+        bool nextMatchIn(Window& window, const SearchSpec& spec,
+            pcre2_match_data* md, size_t from, size_t stop, size_t overlap,
+            FileReader::MatchView& view) {
+
+            size_t end = window.end();
+            if (from > end || from >= stop)
+                return false;
+
+            if (spec.re == nullptr) {
+                size_t limit = std::min(end, stop + spec.literal.size() - 1);
+                if (limit < from + spec.literal.size())
+                    return false;
+                window.cover(from, limit);
+                size_t found = window.view.substr(0, limit - window.base).find(spec.literal, from - window.base);
+                if (found == std::string_view::npos || found + window.base >= stop)
+                    return false;
+                view = { found + window.base, found + window.base + spec.literal.size(), nullptr, 0,
+                         window.view.substr(found, spec.literal.size()) };
+                return true;
+            }
+
+            size_t first = from - std::min(from, spec.lookbehind);
+            size_t limit = std::min(end, stop + overlap);
             while (true) {
-                rc = pcre2_match(re, subject, subject_length, startOffset, opt_match, match_data,
-                    NULL);
+                window.cover(first, limit);
+                // a subject starting inside a UTF-8 sequence fails the UTF check
+                size_t begin = std::max(first, window.base);
+                while (spec.utf && begin < from && (window.view[begin - window.base] & 0xC0) == 0x80)
+                    begin++;
+                uint32_t opts = spec.opt_match;
+                if (limit < end)
+                    opts |= PCRE2_PARTIAL_HARD;
+                if (begin > 0)
+                    opts |= PCRE2_NOTBOL;
+
+                int rc = pcre2_match(spec.re, (PCRE2_SPTR)(window.view.data() + (begin - window.base)),
+                    limit - begin, from - begin, opts, md, NULL);
+                PCRE2_SIZE* ovector = pcre2_get_ovector_pointer(md);
+
+                if (rc == PCRE2_ERROR_PARTIAL) {
+                    if (begin + ovector[0] >= stop)
+                        return false;
+                    limit = std::min(end, limit + (limit - first));
+                    continue;
+                }
 
                 if (rc == PCRE2_ERROR_NOMATCH)
-                    break;
+                    return false;
 
                 if (rc < 0) {
                     PCRE2_UCHAR buffer[256];
-                    int len = pcre2_get_error_message(rc, buffer, sizeof(buffer));
+                    pcre2_get_error_message(rc, buffer, sizeof(buffer));
+                    LERROR("PCRE2 error: " << buffer);
+                    throw std::runtime_error("PCRE2 match error");
+                }
+
+                if (begin + ovector[0] >= stop)
+                    return false;
+
+                // offsets into the file like the sequential search
+                for (int i = 0; i < 2 * rc; i++) {
+                    if (ovector[i] != PCRE2_UNSET)
+                        ovector[i] += begin;
+                }
+                view = { ovector[0], ovector[1], ovector, rc,
+                         window.view.substr(ovector[0] - window.base, ovector[1] - ovector[0]) };
+                return true;
+            }
+        }
+
+        // where the sequential search resumes after a match
+        size_t resumeAfter(size_t start, size_t end) {
+            return start == end ? end + 1 : end;
+        }
 
-                    if (len > 0) {
-                        LERROR("PCRE2 error: " << buffer);
+        struct ChunkJob {
+            std::vector<size_t> bounds; // chunk k is [bounds[k], bounds[k + 1])
+            std::vector<FileReader::MatchBuffer> parts;
+            std::atomic<size_t> next{ 0 };
+            std::mutex mtx;
+            std::condition_variable finished;
+            size_t done = 0;
+            std::exception_ptr error;
+        };
+
+        size_t parallelSearch(ThreadPool& pool, const Content& content, const SearchSpec& spec,
+            size_t chunkSize, FileReader::MatchBuffer& result) {
+
+            constexpr size_t overlap = 4096;
+            size_t chunks = (content.size + chunkSize - 1) / chunkSize;
+
+            // the last chunk owns the empty match at the very end. A UTF pattern
+            // must not start inside a character, so its splits move forward to
+            // the next lead byte
+            auto job = std::make_shared<ChunkJob>();
+            auto& bounds = job->bounds;
+            bounds.resize(chunks + 1);
+            bounds[chunks] = content.size + 1;
+            {
+                Window window(content);
+                for (size_t k = 1; k < chunks; k++) {
+                    size_t at = k * chunkSize;
+                    if (spec.utf) {
+                        window.cover(at, at + 4);
+                        while (at < content.size && at - window.base < window.view.size()
+                            && (window.view[at - window.base] & 0xC0) == 0x80)
+                            at++;
                     }
-                    else {
-                        LERROR("Unknown PCRE2 error: " << rc);
+                    bounds[k] = at;
+                }
+            }
+            auto chunkStop = [job](size_t k) {
+                return job->bounds[k + 1];
+                };
+
+            job->parts.resize(chunks);
+
+            // claims chunks until none are left, the caller runs this too so the
+            // search finishes even when every pool worker is busy; a helper
+            // starting after the last chunk was claimed touches neither content
+            // nor spec.re, the caller may have returned and both be gone
+            auto work = [job, &content, &spec, chunks, chunkStop]() {
+                pcre2_match_data* md = nullptr;
+                std::unique_ptr<Window> window;
+                for (size_t k = job->next++; k < chunks; k = job->next++) {
+                    if (spec.re && md == nullptr)
+                        md = pcre2_match_data_create_from_pattern(spec.re, NULL);
+                    size_t stop = chunkStop(k);
+                    FileReader::MatchView view;
+                    auto& part = job->parts[k];
+                    part.clear();
+                    try {
+                        if (!window)
+                            window = std::make_unique<Window>(content);
+                        for (size_t pos = job->bounds[k];
+                            nextMatchIn(*window, spec, md, pos, stop, overlap, view);
+                            pos = resumeAfter(view.start, view.end)) {
+                            part.push(view);
+                        }
                     }
-                    pcre2_match_data_free(match_data);
-                    throw std::runtime_error("PCRE2 match error");
+                    catch (...) {
+                        std::lock_guard<std::mutex> lock(job->mtx);
+                        job->error = std::current_exception();
+                    }
+                    std::lock_guard<std::mutex> lock(job->mtx);
+                    if (++job->done == chunks)
+                        job->finished.notify_all();
                 }
-                ovector = pcre2_get_ovector_pointer(match_data);
+                if (md)
+                    pcre2_match_data_free(md);
+                };
+
+            size_t helpers = std::min<size_t>(chunks - 1, std::thread::hardware_concurrency());
+            for (size_t i = 0; i < helpers; i++)
+                pool.enqueue(work);
+            work();
+
+            {
+                std::unique_lock<std::mutex> lock(job->mtx);
+                job->finished.wait(lock, [&job, chunks] { return job->done == chunks; });
+            }
 
-                MatchResult match;
-                TSRange range;
+            if (job->error)
+                std::rethrow_exception(job->error);
+
+            // stitch in order, a match running over a chunk boundary shifts where the
+            // sequential search resumes, so rescan until it lands on a known match
+            result.clear();
+            pcre2_match_data* md = spec.re ? pcre2_match_data_create_from_pattern(spec.re, NULL) : nullptr;
+            Window window(content);
+            size_t resume = 0;
+            for (size_t k = 0; k < chunks; k++) {
+                const auto& part = job->parts[k];
+                size_t stop = chunkStop(k);
+                size_t i = 0;
+
+                if (resume > bounds[k]) {
+                    FileReader::MatchView view;
+                    while (nextMatchIn(window, spec, md, resume, stop, overlap, view)) {
+                        while (i < part.size() && part.start[i] < view.start)
+                            i++;
+                        if (i < part.size() && part.start[i] == view.start && part.end[i] == view.end)
+                            break; // back in step with the chunk
+                        result.push(view);
+                        resume = resumeAfter(view.start, view.end);
+                    }
+                    while (i < part.size() && part.start[i] < resume)
+                        i++;
+                }
 
-                range.start_byte = static_cast<uint32_t>(ovector[0]);
-                range.end_byte = static_cast<uint32_t>(ovector[1]);
+                for (; i < part.size(); i++) {
+                    result.pushFrom(part, i);
+                    resume = resumeAfter(part.start[i], part.end[i]);
+                }
+            }
+            if (md)
+                pcre2_match_data_free(md);
 
-                range.start_point = getP(range.start_byte);
-                range.end_point = getP(range.end_byte);
+            DEBUG("FileReader parallelSearch chunks - " << chunks << " matches - " << result.size());
+            return result.size();
+        }
+    }
 
-                match.match = range;
+    size_t FileReader::findInto(ThreadPool& pool, MatchBuffer& out, const std::string& pattern,
+        bool regex, uint32_t opt_compile) {
+        if (regex) {
+            pcre2_code* re = PcreCache::global().get(pattern, opt_compile);
+            return findWithInto(pool, out, re);
+        }
 
-                for (int i = 1; i < rc; i++) {
-                    PCRE2_SIZE start = ovector[2 * i];
-                    PCRE2_SIZE end = ovector[2 * i + 1];
+        size_t fileEnd = snapshotMode ? bufSize : file.size;
+        if (!_isValid || pattern.empty() || fileEnd < 2 * parallelChunkSize) {
+            return findInto(out, pattern, regex, opt_compile);
+        }
 
-                    if (start == PCRE2_UNSET || end == PCRE2_UNSET)
-                        continue;
+        DEBUG("FileReader findInto parallel - " << pattern);
+        // nothing is loaded, each worker reads its own chunk
+        Content content{ std::string_view(buf.data(), bufSize), file.pathStr, fileEnd };
+        SearchSpec spec;
+        spec.literal = pattern;
+        return parallelSearch(pool, content, spec, parallelChunkSize, out);
+    }
+
+    size_t FileReader::findWithInto(ThreadPool& pool, MatchBuffer& out, pcre2_code* re,
+        uint32_t opt_match) {
+        size_t fileEnd = snapshotMode ? bufSize : file.size;
+        if (!_isValid || fileEnd < 2 * parallelChunkSize) {
+            return findWithInto(out, re, opt_match);
+        }
+
+        DEBUG("FileReader findWithInto parallel");
+        Content content{ std::string_view(buf.data(), bufSize), file.pathStr, fileEnd };
+        SearchSpec spec;
+        spec.re = re;
+        spec.opt_match = opt_match;
+        uint32_t lookbehind = 0, options = 0;
+        pcre2_pattern_info(re, PCRE2_INFO_MAXLOOKBEHIND, &lookbehind);
+        pcre2_pattern_info(re, PCRE2_INFO_ALLOPTIONS, &options);
+        spec.utf = (options & PCRE2_UTF) != 0;
+        // at least one byte for \b and ^ in multiline mode, up to 4 per UTF-8 character
+        spec.lookbehind = std::max<size_t>(lookbehind, 1) * (spec.utf ? 4 : 1);
+        return parallelSearch(pool, content, spec, parallelChunkSize, out);
+    }
 
-                    TSRange capture = _makeRange(start, end, rowOffsets);
-                    match.captures.push_back(capture);
+    // the parallel search leaves most of a big file unread, rows are then
+    // counted in one forward pass instead of loading the file for rowOffsets
+    void FileReader::resolve(MatchBuffer& matches) {
+        if (matches.resolved)
+            return;
+        size_t last = 0;
+        for (size_t i = 0; i < matches.size(); i++)
+            last = std::max(last, matches.end[i]);
+        for (size_t e : matches.capEnd) {
+            if (e != PCRE2_UNSET)
+                last = std::max(last, e);
+        }
+        if (snapshotMode || last <= bufSize) {
+            matches.resolve(getRowOffsets());
+            return;
+        }
+
+        DEBUG("FileReader resolve streaming - " << matches.size());
+        matches.startPoint.resize(matches.size());
+        matches.endPoint.resize(matches.size());
+        matches.capStartPoint.assign(matches.capStart.size(), TSPoint{});
+        matches.capEndPoint.assign(matches.capStart.size(), TSPoint{});
+
+        std::vector<std::pair<size_t, TSPoint*>> wanted;
+        wanted.reserve(2 * (matches.size() + matches.capStart.size()));
+        for (size_t i = 0; i < matches.size(); i++) {
+            wanted.emplace_back(matches.start[i], &matches.startPoint[i]);
+            wanted.emplace_back(matches.end[i], &matches.endPoint[i]);
+        }
+        for (size_t c = 0; c < matches.capStart.size(); c++) {
+            if (matches.capStart[c] != PCRE2_UNSET)
+                wanted.emplace_back(matches.capStart[c], &matches.capStartPoint[c]);
+            if (matches.capEnd[c] != PCRE2_UNSET)
+                wanted.emplace_back(matches.capEnd[c], &matches.capEndPoint[c]);
+        }
+        std::sort(wanted.begin(), wanted.end(),
+            [](const auto& a, const auto& b) { return a.first < b.first; });
+
+        Content content{ std::string_view(buf.data(), bufSize), file.pathStr, file.size };
+        Window window(content);
+        uint32_t row = 0;
+        size_t lineStart = 0;
+        size_t scanned = 0;
+        for (auto& [at, point] : wanted) {
+            while (scanned < at) {
+                window.cover(scanned, at, blockSize);
+                size_t to = std::min(at, window.base + window.view.size());
+                const char* data = window.view.data();
+                size_t pos = scanned - window.base;
+                while (const void* nl = std::memchr(data + pos, '\n', to - window.base - pos)) {
+                    pos = static_cast<const char*>(nl) - data + 1;
+                    row++;
+                    lineStart = window.base + pos;
                 }
+                scanned = to;
+            }
+            *point = { row, static_cast<uint32_t>(at - lineStart) };
+        }
+        matches.resolved = true;
+    }
 
-                startOffset = ovector[1];
-                if (ovector[0] == ovector[1]) { // 0 length matches can exist
-                    if (startOffset < subject_length)
-                        startOffset++;
-                    else
-                        break;
+    std::vector<FileReader::MatchResult> FileReader::find(ThreadPool& pool,
+        const std::string& pattern, bool regex, uint32_t opt_compile) {
+        MatchBuffer out;
+        findInto(pool, out, pattern, regex, opt_compile);
+        resolve(out);
+        return out.toMatchResults();
+    }
+
+    std::vector<FileReader::MatchResult> FileReader::findWith(ThreadPool& pool,
+        pcre2_code* re, uint32_t opt_match) {
+        MatchBuffer out;
+        findWithInto(pool, out, re, opt_match);
+        resolve(out);
+        return out.toMatchResults();
+    }
+
+    void FileReader::MatchBuffer::pushFrom(const MatchBuffer& other, size_t i) {
+        if (capBegin.empty())
+            capBegin.push_back(0);
+        start.push_back(other.start[i]);
+        end.push_back(other.end[i]);
+        for (size_t c = other.capBegin[i]; c < other.capBegin[i + 1]; c++) {
+            capStart.push_back(other.capStart[c]);
+            capEnd.push_back(other.capEnd[c]);
+        }
+        capBegin.push_back(capStart.size());
+        resolved = false;
+    }
+
+    void FileReader::MatchBuffer::clear() {
+        start.clear();
+        end.clear();
+        capBegin.clear();
+        capBegin.push_back(0);
+        capStart.clear();
+        capEnd.clear();
+        startPoint.clear();
+        endPoint.clear();
+        capStartPoint.clear();
+        capEndPoint.clear();
+        resolved = false;
+    }
+
+    void FileReader::MatchBuffer::push(const MatchView& view) {
+        if (capBegin.empty())
+            capBegin.push_back(0);
+        start.push_back(view.start);
+        end.push_back(view.end);
+        for (int i = 1; i < view.pairs; i++) {
+            capStart.push_back(view.ovector[2 * i]);
+            capEnd.push_back(view.ovector[2 * i + 1]);
+        }
+        capBegin.push_back(capStart.size());
+        resolved = false;
+    }
+
+    void FileReader::MatchBuffer::resolve(const std::vector<size_t>& rowOffsets) {
+        if (resolved)
+            return;
+
+        DEBUG("FileReader MatchBuffer resolve - " << size());
+        startPoint.resize(size());
+        endPoint.resize(size());
+        capStartPoint.resize(capStart.size());
+        capEndPoint.resize(capStart.size());
+
+        if (rowOffsets.empty()) {
+            for (size_t i = 0; i < size(); i++) {
+                startPoint[i] = { 0, static_cast<uint32_t>(start[i]) };
+                endPoint[i] = { 0, static_cast<uint32_t>(end[i]) };
+            }
+            for (size_t c = 0; c < capStart.size(); c++) {
+                capStartPoint[c] = { 0, static_cast<uint32_t>(capStart[c]) };
+                capEndPoint[c] = { 0, static_cast<uint32_t>(capEnd[c]) };
+            }
+            resolved = true;
+            return;
+        }
+
+        // walks forward from row, offsets before rowOffsets[row] are not expected
+        auto walk = [&rowOffsets](size_t row, size_t offset) {
+            while (row + 1 < rowOffsets.size() && rowOffsets[row + 1] <= offset)
+                row++;
+            return row;
+        };
+        auto point = [&rowOffsets](size_t row, size_t offset) -> TSPoint {
+            return { static_cast<uint32_t>(row), static_cast<uint32_t>(offset - rowOffsets[row]) };
+        };
+
+        // match starts are ascending, everything inside a match lies after its start
+        size_t row = 0;
+        for (size_t i = 0; i < size(); i++) {
+            row = walk(row, start[i]);
+            startPoint[i] = point(row, start[i]);
+
+            size_t endRow = walk(row, end[i]);
+            endPoint[i] = point(endRow, end[i]);
+
+            for (size_t c = capBegin[i]; c < capBegin[i + 1]; c++) {
+                if (capStart[c] == PCRE2_UNSET || capEnd[c] == PCRE2_UNSET || capStart[c] < start[i]) {
+                    // unset, or \K / lookbehind moved it before the match start
+                    capStartPoint[c] = capStart[c] == PCRE2_UNSET ? TSPoint{} : _getP(capStart[c], rowOffsets);
+                    capEndPoint[c] = capEnd[c] == PCRE2_UNSET ? TSPoint{} : _getP(capEnd[c], rowOffsets);
+                    continue;
                 }
+                size_t capRow = walk(row, capStart[c]);
+                capStartPoint[c] = point(capRow, capStart[c]);
+                capEndPoint[c] = point(walk(capRow, capEnd[c]), capEnd[c]);
+            }
+        }
+        resolved = true;
+    }
+
+    TSRange FileReader::MatchBuffer::range(size_t i) const {
+        assert(resolved);
+        TSRange r;
+        r.start_byte = static_cast<uint32_t>(start[i]);
+        r.end_byte = static_cast<uint32_t>(end[i]);
+        r.start_point = startPoint[i];
+        r.end_point = endPoint[i];
+        return r;
+    }
+
+    TSRange FileReader::MatchBuffer::capture(size_t i, size_t j) const {
+        assert(resolved);
+        size_t c = capBegin[i] + j;
+        TSRange r;
+        r.start_byte = static_cast<uint32_t>(capStart[c]);
+        r.end_byte = static_cast<uint32_t>(capEnd[c]);
+        r.start_point = capStartPoint[c];
+        r.end_point = capEndPoint[c];
+        return r;
+    }
+
+    std::vector<FileReader::MatchResult> FileReader::MatchBuffer::toMatchResults() const {
+        std::vector<MatchResult> matches;
+        matches.reserve(size());
+        for (size_t i = 0; i < size(); i++) {
+            MatchResult match;
+            match.match = range(i);
+            for (size_t j = 0; j < captureCount(i); j++) {
+                size_t c = capBegin[i] + j;
+                if (capStart[c] == PCRE2_UNSET || capEnd[c] == PCRE2_UNSET)
+                    continue;
+                match.captures.push_back(capture(i, j));
+            }
+            matches.push_back(std::move(match));
+        }
+        return matches;
+    }
+
+    size_t FileReader::findEach(const std::string& pattern, const MatchSink& sink,
+        bool regex, uint32_t opt_compile) {
+
+        if (regex) {
+            pcre2_code* re = PcreCache::global().get(pattern, opt_compile);
+            return findEachWith(re, sink);
+        }
+
+        if (!_isValid || pattern.empty())
+            return 0;
 
-                if (startOffset >= subject_length)
+        DEBUG("FileReader findEach literal - " << pattern);
+        size_t fileEnd = snapshotMode ? bufSize : file.size;
+        size_t count = 0;
+        size_t offset = 0;
+        size_t loaded = loadUpTo(blockSize);
+
+        while (true) {
+            std::string_view searchSpace(buf.data(), loaded);
+            size_t foundPos = searchSpace.find(pattern, offset);
+
+            if (foundPos != std::string_view::npos) {
+                MatchView view = { foundPos, foundPos + pattern.size(), nullptr, 0,
+                                   searchSpace.substr(foundPos, pattern.size()) };
+                count++;
+                if (!sink(view))
                     break;
+                offset = view.end;
+                continue;
+            }
+
+            if (loaded >= fileEnd)
+                break;
 
-                matches.push_back(match);
-            };
+            // a match may straddle the block boundary
+            if (loaded >= pattern.size())
+                offset = std::max(offset, loaded - pattern.size() + 1);
 
-            pcre2_match_data_free(match_data);
+            size_t next = loadUpTo(loaded + blockSize);
+            if (next <= loaded)
+                break; // short read
+            loaded = next;
         }
-        RESTORE_ITER_INFO;
 
-        DEBUG("FileReader findWith done");
-        return matches;
-    };
+        DEBUG("FileReader findEach literal done - " << count);
+        return count;
+    }
+
+    size_t FileReader::findEachWith(pcre2_code* re, const MatchSink& sink,
+        uint32_t opt_match) {
+
+        if (!_isValid)
+            return 0;
+
+        DEBUG("FileReader findEachWith");
+        size_t fileEnd = snapshotMode ? bufSize : file.size;
+        size_t count = 0;
+        PCRE2_SIZE startOffset = 0;
+        size_t loaded = loadUpTo(blockSize);
+
+        uint32_t options = 0;
+        pcre2_pattern_info(re, PCRE2_INFO_ALLOPTIONS, &options);
+        bool utf = (options & PCRE2_UTF) != 0;
+
+        pcre2_match_data* match_data = pcre2_match_data_create_from_pattern(re, NULL);
+
+        while (startOffset <= loaded) {
+            bool atEnd = loaded >= fileEnd;
+            // while streaming, a hit on the end of the loaded data asks for the next block
+            uint32_t opts = atEnd ? opt_match : opt_match | PCRE2_PARTIAL_HARD;
+
+            // a block may end inside a character, a UTF pattern stops before it
+            size_t subject = loaded;
+            if (utf && !atEnd) {
+                while (subject > startOffset && ((unsigned char)buf.data()[subject - 1] & 0xC0) == 0x80)
+                    subject--;
+                if (subject > startOffset && (unsigned char)buf.data()[subject - 1] >= 0xC0)
+                    subject--;
+            }
+
+            int rc = pcre2_match(re, (PCRE2_SPTR)buf.data(), subject, startOffset,
+                opts, match_data, NULL);
+            PCRE2_SIZE* ovector = pcre2_get_ovector_pointer(match_data);
+
+            if (rc == PCRE2_ERROR_PARTIAL || (rc == PCRE2_ERROR_NOMATCH && !atEnd)) {
+                startOffset = rc == PCRE2_ERROR_PARTIAL ? ovector[0] : subject;
+                size_t next = loadUpTo(loaded + blockSize);
+                if (next <= loaded)
+                    break; // short read
+                loaded = next;
+                continue;
+            }
+
+            if (rc == PCRE2_ERROR_NOMATCH)
+                break;
+
+            if (rc < 0) {
+                PCRE2_UCHAR buffer[256];
+                int len = pcre2_get_error_message(rc, buffer, sizeof(buffer));
+
+                if (len > 0) {
+                    LERROR("PCRE2 error: " << buffer);
+                }
+                else {
+                    LERROR("Unknown PCRE2 error: " << rc);
+                }
+                pcre2_match_data_free(match_data);
+                throw std::runtime_error("PCRE2 match error");
+            }
+
+            MatchView view = { ovector[0], ovector[1], ovector, rc,
+                               std::string_view(buf.data() + ovector[0], ovector[1] - ovector[0]) };
+            count++;
+            if (!sink(view))
+                break;
+
+            startOffset = ovector[1];
+            if (ovector[0] == ovector[1]) { // 0 length matches can exist
+                if (startOffset >= fileEnd)
+                    break;
+                startOffset++;
+            }
+        }
+
+        pcre2_match_data_free(match_data);
+        DEBUG("FileReader findEachWith done - " << count);
+        return count;
+    }
+
+    bool FileReader::exists(const std::string& pattern, bool regex, uint32_t opt_compile) {
+        return findEach(pattern, [](const MatchView&) { return false; }, regex, opt_compile) > 0;
+    }
+
+    size_t FileReader::count(const std::string& pattern, bool regex, uint32_t opt_compile) {
+        return findEach(pattern, [](const MatchView&) { return true; }, regex, opt_compile);
+    }
+
+    std::optional<FileReader::MatchResult> FileReader::findFirst(const std::string& pattern,
+        bool regex, uint32_t opt_compile) {
+        std::optional<MatchResult> first;
+        findEach(pattern, [this, &first](const MatchView& view) {
+            first = toMatchResult(view);
+            return false;
+            }, regex, opt_compile);
+        return first;
+    }
 
     FileSnapshot FileReader::snapshot() {
 
@@ -525,7 +1324,13 @@ namespace copypasta {
         }
         RESTORE_ITER_INFO;
 
-        snap.cont = std::string(buf.data(), bufSize);
+        if (buf.size() == bufSize) {
+            snap.cont = buf;
+        }
+        else {
+            SharedText::countCopy();
+            snap.cont = std::string(buf.data(), bufSize);
+        }
         return snap;
     }
 
@@ -552,7 +1357,7 @@ namespace copypasta {
             bufStart = pos;
         }
 
-        char* currPtr = &buf.data()[pos];
+        const char* currPtr = &buf.data()[pos];
 
         if (readReverse) {
             pos = (pos >= currentBlockSize) ? pos - currentBlockSize : 0;
@@ -580,7 +1385,7 @@ namespace copypasta {
             bufStart = pos;
         }
 
-        char* currPtr = &buf.data()[pos];
+        const char* currPtr = &buf.data()[pos];
 
         if (readReverse) {
             if (pos < fileEnd - 1) {
@@ -611,26 +1416,101 @@ namespace copypasta {
 
     // FileWriter
 
+    // next to dest so the rename stays on one filesystem, the pid keeps
+    // two runs over the same tree from sharing a temp file
+    std::string FileWriter::tempPathFor(const std::string& dest) {
+        static std::atomic<size_t> counter{ 0 };
+#if defined(__linux__) || defined(__unix__) || defined(__APPLE__)
+        long pid = (long)::getpid();
+#else
+        long pid = 0;
+#endif
+        return dest + ".cp" + std::to_string(pid) + "." + std::to_string(counter.fetch_add(1)) + ".tmp";
+    }
+
+    namespace {
+        // a symlink is written through like ofstream does, the temp file and
+        // the rename go to the file it points to instead of replacing the link
+        std::string writeTarget(const std::string& dest) {
+            std::error_code ec;
+            if (!fs::is_symlink(dest, ec))
+                return dest;
+            fs::path resolved = fs::weakly_canonical(dest, ec);
+            return ec ? dest : resolved.string();
+        }
+
+        // the data is on disk before the file is renamed over the original,
+        // a crash after that leaves either the old content or the new one
+        bool syncData(int fd) {
+#ifdef __linux__
+            return ::fdatasync(fd) == 0;
+#elif defined(__unix__) || defined(__APPLE__)
+            return ::fsync(fd) == 0;
+#else
+            return true;
+#endif
+        }
+
+        bool syncData(const std::string& path) {
+#if defined(__linux__) || defined(__unix__) || defined(__APPLE__)
+            int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
+                return false;
+            bool ok = syncData(fd);
+            ::close(fd);
+            return ok;
+#else
+            return true;
+#endif
+        }
+    }
+
     const std::vector<size_t>& FileWriter::getRowOffsets() {
-        UPDATE_ROW_OFFSETS(snap.cont, snap.cont.length());
+        if (!rowOffsetsValid) {
+            DEBUG_FULL("Updating row offsets - " << cont.size());
+            rowOffsets.clear();
+            rowOffsets.push_back(0);
+            size_t base = 0;
+            cont.forEachChunk([this, &base](std::string_view chunk) {
+                const char* p = chunk.data();
+                const char* end = p + chunk.size();
+                while ((p = static_cast<const char*>(std::memchr(p, '\n', end - p))) != nullptr) {
+                    rowOffsets.push_back(base + (p - chunk.data()) + 1);
+                    p++;
+                }
+                base += chunk.size();
+                return true;
+                });
+            rowOffsetsValid = true;
+        }
         return rowOffsets;
     }
 
+    const FileSnapshot FileWriter::snapshot() const {
+        FileSnapshot s = snap;
+        s.cont = cont.flatten();
+        return s;
+    }
+
     FileWriter::FileWriter(const FileSnapshot snap) {
         DEBUG_FULL("FileWriter ctor with snap");
         this->snap = snap;
+        this->snap.cont = SharedText();
+        cont.assign(snap.cont);
         file = snap.file;
         _isValid = file.isValid;
         rowOffsetsValid = false;
-        UPDATE_ROW_OFFSETS(snap.cont, snap.cont.length());
     };
 
     FileWriter::FileWriter(std::string path) {
         DEBUG_FULL("FileWriter ctor with path");
         FileReader tmp(path);
         snap = tmp.snapshot();
+        cont.assign(snap.cont); // shares the reader's buffer
+        snap.cont = SharedText();
         file = tmp.getFile();
         rowOffsets = tmp.getRowOffsets();
+        rowOffsetsValid = true; // snapshot() loaded the whole file
         _isValid = file.isValid;
     }
 
@@ -641,18 +1521,53 @@ namespace copypasta {
             tmp.sync();
         }
         snap = tmp.snapshot();
+        cont.assign(snap.cont); // shares the reader's buffer
+        snap.cont = SharedText();
         file = tmp.getFile();
         rowOffsets = tmp.getRowOffsets();
+        rowOffsetsValid = true;
         _isValid = file.isValid;
     }
 
     FileWriter::FileWriter(const FileWriter& copy) {
         DEBUG_FULL("FileWriter copy ctor");
+        *this = copy;
+    };
+
+    FileWriter::FileWriter(FileWriter&& other) noexcept {
+        DEBUG_FULL("FileWriter move ctor");
+        *this = std::move(other);
+    }
+
+    // the output stream stays with the writer that opened it
+    FileWriter& FileWriter::operator=(const FileWriter& copy) {
+        if (this == &copy)
+            return *this;
         snap = copy.snap;
+        cont = copy.cont; // shares every piece
         file = copy.file;
         rowOffsets = copy.rowOffsets;
+        rowOffsetsValid = copy.rowOffsetsValid;
         _isValid = copy.file.isValid;
-    };
+        return *this;
+    }
+
+    FileWriter& FileWriter::operator=(FileWriter&& other) noexcept {
+        if (this == &other)
+            return *this;
+        if (oFileStream.is_open())
+            oFileStream.close();
+        oFileStream = std::move(other.oFileStream);
+        snap = std::move(other.snap);
+        cont = std::move(other.cont);
+        file = std::move(other.file);
+        rowOffsets = std::move(other.rowOffsets);
+        rowOffsetsValid = other.rowOffsetsValid;
+        _isValid = other._isValid;
+        other._isValid = false;
+        other.rowOffsetsValid = false;
+        return *this;
+    }
 
     FileWriter::~FileWriter() {
         DEBUG_FULL("FileReader destroyed");
@@ -676,30 +1591,133 @@ namespace copypasta {
     };
 
     TSPoint FileWriter::getP(size_t byteOffset) {
-        return copypasta::_getP(byteOffset, rowOffsets);
+        return copypasta::_getP(byteOffset, getRowOffsets());
     };
 
+    // SaveBatch
+
+    void SaveBatch::recordSaved(const fs::path& file) {
+        saved++;
+        std::string dir = file.has_parent_path() ? file.parent_path().string() : ".";
+        std::lock_guard<std::mutex> lock(mtx);
+        if (dirs.empty() || dirs.back() != dir) {
+            dirs.push_back(std::move(dir));
+        }
+    }
+
+    bool SaveBatch::flush() {
+        std::vector<std::string> toSync;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            toSync.swap(dirs);
+        }
+        if (toSync.empty()) {
+            return true;
+        }
+        std::sort(toSync.begin(), toSync.end());
+        toSync.erase(std::unique(toSync.begin(), toSync.end()), toSync.end());
+        DEBUG("SaveBatch flush - " << toSync.size() << " dirs");
+
+        bool ok = true;
+#if defined(__linux__) || defined(__unix__) || defined(__APPLE__)
+        // file data was synced before each rename, only the renames are left
+        for (auto& dir : toSync) {
+            int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (fd < 0) {
+                WARN("SaveBatch unable to open - " << dir);
+                ok = false;
+                continue;
+            }
+            if (::fsync(fd) != 0) {
+                WARN("SaveBatch fsync failed - " << dir << " - " << std::strerror(errno));
+                ok = false;
+            }
+            ::close(fd);
+        }
+#else
+        WARN("SaveBatch flush, directories can not be synced on this platform - " << toSync.size());
+#endif
+        return ok;
+    }
+
+    void SaveBatch::reset() {
+        std::lock_guard<std::mutex> lock(mtx);
+        dirs.clear();
+        saved = 0;
+        skipped = 0;
+        failed = 0;
+    }
+
+    bool FileWriter::sameAsDisk() const {
+        std::error_code ec;
+        size_t diskSize = fs::file_size(file.pathStr, ec);
+        if (ec || diskSize != cont.size()) {
+            return false;
+        }
+        std::ifstream in(file.pathStr, std::ios::in | std::ios::binary);
+        std::vector<char> block(64 * 1024);
+        bool same = in.good();
+        cont.forEachChunk([&in, &block, &same](std::string_view chunk) {
+            while (same && !chunk.empty()) {
+                size_t len = std::min(block.size(), chunk.size());
+                in.read(block.data(), len);
+                same = (size_t)in.gcount() == len && std::memcmp(block.data(), chunk.data(), len) == 0;
+                chunk.remove_prefix(len);
+            }
+            return same;
+            });
+        return same;
+    }
+
     bool FileWriter::save() {
         INFO("FileWriter save - \n" << file.pathStr);
-        std::ofstream bkp =
-            std::ofstream(file.pathStr, std::ios::out | std::ios::trunc);
-        snap.cont.shrink_to_fit();
-        bkp << snap.cont;
-
-        bkp.flush();
-        bool res = bkp.good();
-        bkp.close();
-        file.sync();
-        if (res) {
+        if (file.pathStr.empty()) {
+            WARN("FileWriter save without a file");
+            return false;
+        }
+        if (sameAsDisk()) {
+            DEBUG("FileWriter save skipped, unchanged - " << file.pathStr);
+            SaveBatch::global().recordSkipped();
             snap.dirty = false;
+            return true;
         }
-        return res;
+
+        std::string dest = writeTarget(file.pathStr);
+        std::string tmp = tempPathFor(dest);
+        std::ofstream target = std::ofstream(tmp, std::ios::out | std::ios::trunc | std::ios::binary);
+        cont.writeTo(target);
+        target.flush();
+        bool res = target.good();
+        target.close();
+
+        std::error_code ec;
+        if (res && fs::exists(dest, ec)) {
+            fs::permissions(tmp, fs::status(dest, ec).permissions(), ec);
+        }
+        if (res) {
+            res = syncData(tmp);
+        }
+        if (res) {
+            fs::rename(tmp, dest, ec);
+            res = !ec;
+        }
+        if (!res) {
+            LERROR("FileWriter save failed - " << file.pathStr << (ec ? " - " + ec.message() : ""));
+            fs::remove(tmp, ec);
+            SaveBatch::global().recordFailed();
+            return false;
+        }
+
+        SaveBatch::global().recordSaved(file.path.empty() ? fs::path(file.pathStr) : file.path);
+        file.sync();
+        snap.dirty = false;
+        return true;
     };
 
     bool FileWriter::writeTo(const std::string& path) {
         INFO("FileWriter write to " << path);
-        std::ofstream target = std::ofstream(path, std::ios::out | std::ios::trunc);
-        target << snap.cont;
+        std::ofstream target = std::ofstream(path, std::ios::out | std::ios::trunc | std::ios::binary);
+        cont.writeTo(target);
         target.flush();
         bool res = target.good();
         target.close();
@@ -711,10 +1729,41 @@ namespace copypasta {
   snap.dirty = true;                                                           \
   snap.lastModified =                                                          \
       std::chrono::system_clock::now().time_since_epoch().count();             \
-  snap.file.size = snap.cont.length();                                         \
-  rowOffsetsValid = false;                                                     \
+  snap.file.size = cont.size();                                                \
   return *this;
 
+    // rows starting in (from, to] lose their newline, later rows shift and
+    // the newlines of text become new rows, no rescan of the content
+    void FileWriter::splice(size_t from, size_t to, std::string_view text) {
+        to = std::max(from, std::min(to, cont.size()));
+        cont.replace(from, to, text);
+        if (!rowOffsetsValid)
+            return;
+
+        auto lo = std::upper_bound(rowOffsets.begin(), rowOffsets.end(), from);
+        auto hi = std::upper_bound(lo, rowOffsets.end(), to);
+        long long delta = (long long)text.size() - (long long)(to - from);
+        for (auto it = hi; it != rowOffsets.end(); ++it) {
+            *it += delta;
+        }
+
+        std::vector<size_t> added;
+        for (size_t i = 0; i < text.size(); i++) {
+            if (text[i] == '\n')
+                added.push_back(from + i + 1);
+        }
+        size_t removed = hi - lo;
+        size_t at = lo - rowOffsets.begin();
+        if (added.size() <= removed) {
+            std::copy(added.begin(), added.end(), lo);
+            rowOffsets.erase(lo + added.size(), hi);
+        }
+        else {
+            std::copy(added.begin(), added.begin() + removed, lo);
+            rowOffsets.insert(rowOffsets.begin() + at + removed, added.begin() + removed, added.end());
+        }
+    }
+
     FileWriter& FileWriter::copy(std::string& sourcePath) {
         if (!fs::exists(sourcePath)) {
             throw std::invalid_argument(
@@ -724,88 +1773,90 @@ namespace copypasta {
         FileReader tmp(sourcePath);
         File curr = snap.file;
         snap = tmp.snapshot();
+        cont.assign(snap.cont); // shares the reader's buffer
+        snap.cont = SharedText();
         snap.file = curr;
+        rowOffsetsValid = false;
         UPDATE_SNAP_META(snap);
     };
 
-    FileWriter& FileWriter::append(const std::string& cont) {
+    FileWriter& FileWriter::append(const std::string& slice) {
         DEBUG("FileWriter append");
-        snap.cont.append(cont);
+        splice(cont.size(), cont.size(), slice);
         UPDATE_SNAP_META(snap);
     }
 
     FileWriter& FileWriter::insert(size_t offset, const std::string& slice) {
-        assert(offset < snap.cont.size());
+        assert(offset < cont.size());
         DEBUG("FileWriter insert at - " << offset);
-        snap.cont.insert(offset, slice);
+        splice(offset, offset, slice);
         UPDATE_SNAP_META(snap);
     };
 
     FileWriter& FileWriter::write(const std::string& content) {
         DEBUG("FileWriter write content");
-        snap.cont = std::string(content);
+        cont.assign(content);
+        rowOffsetsValid = false;
         UPDATE_SNAP_META(snap);
     }
 
     FileWriter& FileWriter::write(size_t offset, char* newCont, size_t newContLen) {
-        assert(offset < snap.cont.size());
+        assert(offset < cont.size());
         DEBUG("FileWriter write offset - " << offset);
-        snap.cont.erase(offset, newContLen);
-        snap.cont.insert(offset, newCont, newContLen);
+        splice(offset, offset + newContLen, std::string_view(newCont, newContLen));
         UPDATE_SNAP_META(snap);
     };
 
-    FileWriter& FileWriter::write(size_t offset, std::string& cont) {
-        assert(offset < snap.cont.size());
+    FileWriter& FileWriter::write(size_t offset, std::string& slice) {
+        assert(offset < cont.size());
         DEBUG("FileWriter write offset - " << offset);
-        snap.cont.erase(offset, cont.length());
-        snap.cont.insert(offset, cont);
+        splice(offset, offset + slice.length(), slice);
         UPDATE_SNAP_META(snap);
     };
 
-    FileWriter& FileWriter::write(size_t from, size_t to, std::string& cont) {
-        assert(to < snap.cont.size());
+    FileWriter& FileWriter::write(size_t from, size_t to, std::string& slice) {
+        assert(to < cont.size());
         DEBUG("FileWriter write from - " << from << " to - " << to);
-        snap.cont.erase(from, to - from);
-        snap.cont.insert(from, cont);
+        splice(from, to, slice);
         UPDATE_SNAP_META(snap);
     };
 
     FileWriter& FileWriter::deleteCont(size_t from, size_t to) {
-        assert(to < snap.cont.size());
+        assert(to < cont.size());
         DEBUG("FileWriter delete " << from << " to " << to);
-        snap.cont.erase(from, to - from);
+        splice(from, to, "");
         UPDATE_SNAP_META(snap);
     };
 
     FileWriter& FileWriter::deleteRow(size_t row) {
-        UPDATE_ROW_OFFSETS(snap.cont, snap.cont.length());
+        getRowOffsets();
 
         assert(rowOffsets.size() > row);
 
         DEBUG("FileWriter deleteRow - " << row);
 
         size_t row1Offset = rowOffsets[row];
-        size_t row2Offset = rowOffsets[row + 1];
+        size_t row2Offset = row + 1 < rowOffsets.size() ? rowOffsets[row + 1] : cont.size();
 
-        snap.cont.erase(row1Offset, row1Offset - row2Offset);
+        splice(row1Offset, row2Offset, "");
         UPDATE_SNAP_META(snap);
     };
 
-    FileWriter& FileWriter::insertRowBefore(size_t row, const std::string& cont, bool preserveIndent) {
-        UPDATE_ROW_OFFSETS(snap.cont, snap.cont.length());
+    FileWriter& FileWriter::insertRowBefore(size_t row, const std::string& slice, bool preserveIndent) {
+        getRowOffsets();
 
         assert(rowOffsets.size() > row);
 
         DEBUG("FileWriter insertRow - " << row);
 
-        bool hasEndl = cont[cont.length() - 1] == '\n';
+        bool hasEndl = !slice.empty() && slice[slice.length() - 1] == '\n';
         size_t rowOffset = rowOffsets[row];
 
         std::string indent = "";
 
         if (preserveIndent) {
-            std::string line = snap.cont.substr(rowOffset, rowOffset - rowOffsets[row + 1] + 1);
+            size_t rowEnd = row + 1 < rowOffsets.size() ? rowOffsets[row + 1] : cont.size();
+            std::string line = cont.substr(rowOffset, rowEnd - rowOffset);
             int end = 0;
             for (int i = 0; i < line.length(); i++) {
                 auto ch = line[i];
@@ -817,121 +1868,401 @@ namespace copypasta {
             indent = line.substr(0, end);
         }
 
-        snap.cont.insert(rowOffset, indent + cont);
-        if (!hasEndl)
-            snap.cont.insert(rowOffset + indent.length() + cont.length(), 1, '\n');
+        splice(rowOffset, rowOffset, hasEndl ? indent + slice : indent + slice + '\n');
         UPDATE_SNAP_META(snap);
     };
 
-    FileWriter& FileWriter::insertRowAfter(size_t row, const std::string& cont, bool preserveIndent) {
-        return insertRowBefore(row + 1, cont, preserveIndent);
+    FileWriter& FileWriter::insertRowAfter(size_t row, const std::string& slice, bool preserveIndent) {
+        return insertRowBefore(row + 1, slice, preserveIndent);
+    }
+    size_t OffsetMap::map(size_t oldOffset) const {
+        auto it = std::upper_bound(entries.begin(), entries.end(), oldOffset,
+            [](size_t o, const Entry& e) { return o < e.oldTo; });
+        if (it != entries.end() && it->oldFrom < oldOffset) {
+            return it->newTo;
+        }
+        if (it == entries.begin()) {
+            return oldOffset;
+        }
+        --it;
+        return oldOffset - it->oldTo + it->newTo;
     }
-    FileWriter& FileWriter::replaceAll(const std::string& pattern,
-        const std::string& templateOrResult, uint32_t opt) {
-
-        DEBUG("FileWriter replaceAll start - " << pattern << " to " << templateOrResult);
-        pcre2_code* re = PcreCache::global().get(pattern, opt);
 
-        PCRE2_SIZE outLength = snap.cont.length() * 2;
+    namespace {
+        // sorts edits in place and maps them, inserts at the same offset keep
+        // their given order
+        OffsetMap planEdits(std::vector<TextEdit>& edits, size_t size, const char* who) {
+            OffsetMap offsets;
+            std::stable_sort(edits.begin(), edits.end(),
+                [](const TextEdit& a, const TextEdit& b) {
+                    if (a.from != b.from)
+                        return a.from < b.from;
+                    return a.to < b.to;
+                });
+
+            offsets.entries.reserve(edits.size());
+            size_t prevTo = 0;
+            long long delta = 0;
+            for (auto& e : edits) {
+                if (e.to < e.from || e.to > size) {
+                    throw std::invalid_argument(std::string(who) + " range out of bounds - ["
+                        + std::to_string(e.from) + ", " + std::to_string(e.to) + ")");
+                }
+                if (e.from < prevTo) {
+                    throw std::invalid_argument(std::string(who) + " overlapping ranges at - "
+                        + std::to_string(e.from));
+                }
+                prevTo = e.to;
+                size_t newFrom = e.from + delta;
+                offsets.entries.push_back({ e.from, e.to, newFrom, newFrom + e.text.size() });
+                delta += (long long)e.text.size() - (long long)(e.to - e.from);
+            }
+            return offsets;
+        }
+    }
 
-        if (outLength == 0) {
-            return *this;
+    OffsetMap FileWriter::applyBatch(std::vector<TextEdit> edits) {
+        DEBUG("FileWriter applyBatch - " << edits.size());
+        if (edits.empty()) {
+            return OffsetMap();
         }
 
-        std::vector<PCRE2_UCHAR> buffer;
-        int rc = -1;
-    substitute:
-        buffer.resize(outLength);
-        // expands the template with captures and replcaes match
-        rc = pcre2_substitute(
-            re,
-            (PCRE2_SPTR)snap.cont.c_str(), // in buf
-            snap.cont.length(),            // in len
-            0,                              // startOffset 
-            opt,                            // options
-            nullptr,                        // matchData
-            nullptr,                        // matchContext
-            (PCRE2_SPTR)templateOrResult.c_str(), // replacement
-            templateOrResult.length(),           // rlegth
-            (PCRE2_UCHAR*)buffer.data(),        // out buf
-            &outLength);                        // out len
+        OffsetMap offsets = planEdits(edits, cont.size(), "FileWriter applyBatch");
+        size_t prevTo = edits.back().to;
 
-        if (rc == PCRE2_ERROR_NOMEMORY) {
-            LERROR("FileReader replaceAll PCR2_ERROR_NOMEMORY - " << outLength);
-            goto substitute;
+        std::vector<PieceTable::Splice> splices;
+        splices.reserve(edits.size());
+        for (auto& e : edits) {
+            splices.push_back({ e.from, e.to, e.text });
         }
 
-        pcre2_code_free(re);
-
-        if (rc < 0) {
-            throw std::runtime_error("PCRE2 substitution failed");
+        cont.splice(splices);
+
+        if (rowOffsetsValid) {
+            // one merge of the old row starts with the edits
+            std::vector<size_t> rows;
+            rows.reserve(rowOffsets.size());
+            rows.push_back(0);
+            size_t r = 1;
+            for (size_t i = 0; i < edits.size(); i++) {
+                auto& e = edits[i];
+                auto& m = offsets.entries[i];
+                // untouched rows before the edit, shifted by earlier edits
+                for (; r < rowOffsets.size() && rowOffsets[r] <= e.from; r++)
+                    rows.push_back(rowOffsets[r] - e.from + m.newFrom);
+                // rows whose newline was replaced are dropped
+                for (; r < rowOffsets.size() && rowOffsets[r] <= e.to; r++);
+                for (size_t j = 0; j < e.text.size(); j++) {
+                    if (e.text[j] == '\n')
+                        rows.push_back(m.newFrom + j + 1);
+                }
+            }
+            for (; r < rowOffsets.size(); r++)
+                rows.push_back(rowOffsets[r] - prevTo + offsets.entries.back().newTo);
+            rowOffsets = std::move(rows);
         }
 
-        snap.cont.assign(reinterpret_cast<char*>(buffer.data()), outLength);
+        snap.dirty = true;
+        snap.lastModified = std::chrono::system_clock::now().time_since_epoch().count();
+        snap.file.size = cont.size();
+        return offsets;
+    }
 
-        DEBUG("FileWriter replaceAll done - " << pattern << " to " << templateOrResult);
-        UPDATE_SNAP_META(snap);
-    };
+    namespace {
+        // unchanged regions are copied without passing through user space
+        // where the kernel allows it, the block is only used by the fallback
+#ifdef __linux__
+        struct RewriteIo {
+            int in = -1;
+            int out = -1;
+            bool kernelCopy = true;
+            std::vector<char> block;
+
+            ~RewriteIo() {
+                if (in >= 0) ::close(in);
+                if (out >= 0) ::close(out);
+            }
 
-    FileWriter& FileWriter::replace(const std::string& pattern,
-        const std::string& templateOrResult,
-        size_t nth,
-        uint32_t opt) {
+            bool open(const std::string& path, const std::string& tmp) {
+                in = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+                if (in < 0)
+                    return false;
+                struct stat st;
+                mode_t mode = ::fstat(in, &st) == 0 ? (st.st_mode & 07777) : 0644;
+                out = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+                return out >= 0;
+            }
 
-        DEBUG("FileWriter replace start - " << pattern << " to " << templateOrResult);
-        FileReader snapReader(snap);
+            bool write(const char* data, size_t len) {
+                while (len > 0) {
+                    ssize_t n = ::write(out, data, len);
+                    if (n < 0 && errno == EINTR)
+                        continue;
+                    if (n <= 0)
+                        return false;
+                    data += n;
+                    len -= n;
+                }
+                return true;
+            }
 
-        pcre2_code* re = PcreCache::global().get(pattern, opt);
+            // copies [from, to) of the source to the end of the output
+            bool copy(size_t from, size_t to) {
+                while (kernelCopy && from < to) {
+                    loff_t off = from;
+                    ssize_t n = ::copy_file_range(in, &off, out, nullptr, to - from, 0);
+                    if (n < 0 && errno == EINTR)
+                        continue;
+                    if (n <= 0) {
+                        // cross filesystem or unsupported, sendfile still avoids the copy
+                        off_t sendOff = from;
+                        n = ::sendfile(out, in, &sendOff, to - from);
+                    }
+                    if (n <= 0) {
+                        DEBUG("FileWriter rewrite kernel copy unavailable - " << errno);
+                        kernelCopy = false;
+                        break;
+                    }
+                    from += n;
+                }
+                if (from < to && block.empty())
+                    block.resize(FileReader::defaultBlockSize);
+                while (from < to) {
+                    ssize_t n = ::pread(in, block.data(), std::min(block.size(), to - from), from);
+                    if (n < 0 && errno == EINTR)
+                        continue;
+                    if (n <= 0 || !write(block.data(), n))
+                        return false;
+                    from += n;
+                }
+                return true;
+            }
 
-        auto results = snapReader.findWith(re, true);
+            bool close() {
+                int fd = out;
+                out = -1;
+                bool ok = syncData(fd);
+                return ::close(fd) == 0 && ok;
+            }
+        };
+#else
+        struct RewriteIo {
+            std::ifstream in;
+            std::ofstream out;
+            std::string tmp;
+            std::vector<char> block;
+
+            bool open(const std::string& path, const std::string& tmp) {
+                this->tmp = tmp;
+                in.open(path, std::ios::in | std::ios::binary);
+                out.open(tmp, std::ios::out | std::ios::trunc | std::ios::binary);
+                return in.good() && out.good();
+            }
 
-        if (results.empty()) {
-            return *this;
-        }
+            bool write(const char* data, size_t len) {
+                out.write(data, len);
+                return out.good();
+            }
 
-        // (a%b + b)%b for -10 % 100 = 90 && 10 % 100 = 10
-        nth = (nth % results.size() + results.size()) % results.size();
-        auto target = results[nth];
+            bool copy(size_t from, size_t to) {
+                if (block.empty())
+                    block.resize(FileReader::defaultBlockSize);
+                in.seekg(from);
+                while (from < to && in.good()) {
+                    size_t len = std::min(block.size(), to - from);
+                    in.read(block.data(), len);
+                    if ((size_t)in.gcount() != len || !write(block.data(), len))
+                        return false;
+                    from += len;
+                }
+                return from == to;
+            }
 
-        size_t start_offset = target.match.start_byte;
-        size_t end_offset = target.match.end_byte;
+            bool close() {
+                out.flush();
+                bool ok = out.good();
+                out.close();
+                return ok && syncData(tmp);
+            }
+        };
+#endif
+    }
 
-        PCRE2_SIZE outLength = templateOrResult.length() * 2;
+    OffsetMap FileWriter::rewrite(const std::string& path, std::vector<TextEdit> edits,
+        const std::string& target) {
 
-        if (outLength == 0) {
-            return *this;
+        std::string dest = writeTarget(target.empty() ? path : target);
+        DEBUG("FileWriter rewrite - " << path << " to " << dest << " edits - " << edits.size());
+
+        std::error_code ec;
+        size_t size = fs::file_size(path, ec);
+        if (ec) {
+            throw std::runtime_error("FileWriter rewrite unable to stat " + path + " - " + ec.message());
+        }
+        OffsetMap offsets = planEdits(edits, size, "FileWriter rewrite");
+
+        std::string tmp = tempPathFor(dest);
+        bool ok = false;
+        {
+            RewriteIo io;
+            ok = io.open(path, tmp);
+            size_t pos = 0;
+            for (size_t i = 0; ok && i < edits.size(); i++) {
+                auto& e = edits[i];
+                ok = io.copy(pos, e.from) && io.write(e.text.data(), e.text.size());
+                pos = e.to;
+            }
+            ok = ok && io.copy(pos, size);
+            ok = io.close() && ok;
+        }
+        if (ok) {
+            fs::rename(tmp, dest, ec);
+            ok = !ec;
+        }
+        if (!ok) {
+            std::string reason = ec ? ec.message() : std::strerror(errno);
+            fs::remove(tmp, ec);
+            throw std::runtime_error("FileWriter rewrite failed for " + path + " - " + reason);
         }
+        INFO("FileWriter rewrite done - " << dest);
+        return offsets;
+    }
 
-        std::vector<PCRE2_UCHAR> buffer;
-        int rc = -1;
-    substitute:
-        buffer.resize(outLength);
-        rc = pcre2_substitute(re,
-            (PCRE2_SPTR)(snap.cont.c_str() + start_offset),
-            end_offset - start_offset,
-            0,
-            opt,
-            nullptr,
-            nullptr,
-            (PCRE2_SPTR)templateOrResult.c_str(),
-            templateOrResult.length(),
-            (PCRE2_UCHAR*)buffer.data(),
-            &outLength);
+    namespace {
+        // expands the template for the match held in md, into is reused
+        // between matches and grown to the size pcre2 asks for
+        void expandMatch(pcre2_code* re, std::string_view subject, pcre2_match_data* md,
+            const std::string& templ, uint32_t opt, std::string& into) {
 
-        if (rc == PCRE2_ERROR_NOMEMORY) {
-            LERROR("FileReader replace PCR2_ERROR_NOMEMORY - " << outLength);
-            goto substitute;
+            opt = (opt & ~PCRE2_SUBSTITUTE_GLOBAL) | PCRE2_SUBSTITUTE_MATCHED
+                | PCRE2_SUBSTITUTE_REPLACEMENT_ONLY | PCRE2_SUBSTITUTE_OVERFLOW_LENGTH;
+            if (into.size() < templ.size() + 1) {
+                into.resize(templ.size() * 2 + 16);
+            }
+            for (int attempt = 0; attempt < 2; attempt++) {
+                PCRE2_SIZE len = into.size();
+                int rc = pcre2_substitute(re,
+                    (PCRE2_SPTR)subject.data(), subject.size(),
+                    0, opt, md, nullptr,
+                    (PCRE2_SPTR)templ.c_str(), templ.length(),
+                    (PCRE2_UCHAR*)into.data(), &len);
+                if (rc == PCRE2_ERROR_NOMEMORY) {
+                    // len is the size needed including the terminating zero
+                    DEBUG_FULL("FileWriter substitute grow - " << len);
+                    into.resize(len);
+                    continue;
+                }
+                if (rc < 0) {
+                    PCRE2_UCHAR buffer[256];
+                    pcre2_get_error_message(rc, buffer, sizeof(buffer));
+                    throw std::runtime_error(std::string("PCRE2 substitution failed - ")
+                        + reinterpret_cast<char*>(buffer));
+                }
+                into.resize(len);
+                return;
+            }
+            throw std::runtime_error("PCRE2 substitution failed to size its output");
         }
+    }
+
+    OffsetMap FileWriter::substitute(pcre2_code* re, const std::string& templateOrResult,
+        bool all, size_t nth, uint32_t opt) {
+
+        SharedText subjectText = cont.flatten();
+        std::string_view subject = subjectText;
+        bool fromEnd = !all && (long long)nth < 0;
+        size_t back = fromEnd ? (size_t)(-(long long)nth) : 0;
+
+        pcre2_match_data* md = pcre2_match_data_create_from_pattern(re, NULL);
+        std::vector<TextEdit> edits;
+        std::vector<size_t> starts; // search offset of every match, to find the nth again
+        std::string expanded;
+        bool done = false;
+
+        PCRE2_SIZE startOffset = 0;
+        try {
+            while (startOffset <= subject.size()) {
+                int rc = pcre2_match(re, (PCRE2_SPTR)subject.data(), subject.size(),
+                    startOffset, 0, md, NULL);
+                if (rc == PCRE2_ERROR_NOMATCH)
+                    break;
+                if (rc < 0)
+                    throw std::runtime_error("PCRE2 match error - " + std::to_string(rc));
+                PCRE2_SIZE* ovector = pcre2_get_ovector_pointer(md);
+
+                if (all || (!fromEnd && starts.size() == nth)) {
+                    expandMatch(re, subject, md, templateOrResult, opt, expanded);
+                    edits.push_back({ ovector[0], ovector[1], expanded });
+                    if (!all) {
+                        done = true;
+                        break;
+                    }
+                }
+                else {
+                    starts.push_back(startOffset);
+                }
 
-        pcre2_code_free(re);
+                startOffset = ovector[1];
+                if (ovector[0] == ovector[1]) { // 0 length matches can exist
+                    if (startOffset >= subject.size())
+                        break;
+                    startOffset++;
+                }
+            }
 
-        if (rc < 0) {
-            throw std::runtime_error("PCRE2 substitution failed");
+            // counted from the end or past the last match, wraps like an index
+            if (!all && !done && !starts.empty()) {
+                size_t count = starts.size();
+                size_t idx = fromEnd ? (count - back % count) % count : nth % count;
+                pcre2_match(re, (PCRE2_SPTR)subject.data(), subject.size(),
+                    starts[idx], 0, md, NULL);
+                PCRE2_SIZE* ovector = pcre2_get_ovector_pointer(md);
+                expandMatch(re, subject, md, templateOrResult, opt, expanded);
+                edits.push_back({ ovector[0], ovector[1], expanded });
+            }
         }
+        catch (...) {
+            pcre2_match_data_free(md);
+            throw;
+        }
+        pcre2_match_data_free(md);
+
+        DEBUG("FileWriter substitute - " << edits.size() << " replacements");
+        return applyBatch(std::move(edits));
+    }
+
+    OffsetMap FileWriter::substituteAll(pcre2_code* re, const std::string& templateOrResult,
+        uint32_t opt) {
+        return substitute(re, templateOrResult, true, 0, opt);
+    }
+
+    OffsetMap FileWriter::substituteNth(pcre2_code* re, const std::string& templateOrResult,
+        size_t nth, uint32_t opt) {
+        return substitute(re, templateOrResult, false, nth, opt);
+    }
+
+    // opt are substitution options, the pattern is compiled without options
+    FileWriter& FileWriter::replaceAll(const std::string& pattern,
+        const std::string& templateOrResult, uint32_t opt) {
+
+        DEBUG("FileWriter replaceAll start - " << pattern << " to " << templateOrResult);
+        // owned by PcreCache, never freed here
+        pcre2_code* re = PcreCache::global().get(pattern, 0);
+        substituteAll(re, templateOrResult, opt);
+        DEBUG("FileWriter replaceAll done - " << pattern << " to " << templateOrResult);
+        return *this;
+    };
 
+    FileWriter& FileWriter::replace(const std::string& pattern,
+        const std::string& templateOrResult,
+        size_t nth,
+        uint32_t opt) {
+
+        DEBUG("FileWriter replace start - " << pattern << " to " << templateOrResult);
+        pcre2_code* re = PcreCache::global().get(pattern, 0);
+        substituteNth(re, templateOrResult, nth, opt);
         DEBUG("FileWriter replace done - " << pattern << " to " << templateOrResult);
-        return write(start_offset, reinterpret_cast<char*>(buffer.data()),
-            outLength);
+        return *this;
     };
 
 } // namespace copypasta
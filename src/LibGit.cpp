@@ -29,25 +29,51 @@ namespace copypasta {
         setSignature(username, email);
     }
 
-    LibGit::LibGit(LibGit&& other) : repo(std::move(other.repo))
+    LibGit::LibGit(LibGit&& other) noexcept : repo(std::move(other.repo))
         , root(std::move(other.root))
+        , gitMutex(std::move(other.gitMutex))
         , username(std::move(other.username))
         , email(std::move(other.email))
         , signature(other.signature)
-        // mutex is default-constructed fresh — cannot be moved
     {
         DEBUG_FULL("LibGit move ctor");
         other.signature = nullptr;
     }
 
-    LibGit::LibGit(const LibGit& other) {
+    LibGit::LibGit(const LibGit& other) : repo(other.repo)
+        , root(other.root)
+        , gitMutex(other.gitMutex)
+        , username(other.username)
+        , email(other.email)
+    {
         DEBUG_FULL("LibGit copy ctor");
-        root = other.root;
-        username = other.username;
-        email = other.email;
-        setSignature(username, email);
-        LibGit temp = LibGit::open(other.root);
-        repo = std::move(temp.repo);
+        if (other.signature && git_signature_dup(&signature, other.signature) < 0) {
+            throw std::runtime_error("Failed to copy signature");
+        }
+    }
+
+    LibGit& LibGit::operator=(LibGit&& other) noexcept {
+        if (this == &other)
+            return *this;
+        DEBUG_FULL("LibGit move assign");
+        repo = std::move(other.repo);
+        root = std::move(other.root);
+        gitMutex = std::move(other.gitMutex);
+        username = std::move(other.username);
+        email = std::move(other.email);
+        if (signature) {
+            git_signature_free(signature);
+        }
+        signature = other.signature;
+        other.signature = nullptr;
+        return *this;
+    }
+
+    LibGit& LibGit::operator=(const LibGit& other) {
+        if (this == &other)
+            return *this;
+        LibGit copy(other);
+        return *this = std::move(copy);
     }
 
     LibGit::~LibGit() {
@@ -139,7 +165,7 @@ namespace copypasta {
 
         DEBUG("LibGit add " << relPath.c_str());
 
-        std::lock_guard<std::mutex> lock(gitMutex);
+        std::lock_guard<std::mutex> lock(*gitMutex);
         int err = 0;
         err = git_repository_index(&index, repo.get());
         err = git_index_add_bypath(index, relPath.string().c_str());
@@ -156,7 +182,7 @@ namespace copypasta {
     void LibGit::addAll() {
         DEBUG("LibGit add all - " << root);
 
-        std::lock_guard<std::mutex> lock(gitMutex);
+        std::lock_guard<std::mutex> lock(*gitMutex);
         int err = 0;
         git_index* index;
         err = git_repository_index(&index, repo.get());
@@ -174,7 +200,7 @@ namespace copypasta {
     void LibGit::checkout(const std::string& blobId, git_checkout_options opts) {
         DEBUG("LibGit checkout - " << blobId);
 
-        std::lock_guard<std::mutex> lock(gitMutex);
+        std::lock_guard<std::mutex> lock(*gitMutex);
         git_object* target = nullptr;
         git_reference* ref = nullptr;
 
@@ -217,7 +243,7 @@ namespace copypasta {
 
     void LibGit::branchCreate(const std::string& name) {
         DEBUG("LibGit branchCreate - " << name);
-        std::lock_guard<std::mutex> lock(gitMutex);
+        std::lock_guard<std::mutex> lock(*gitMutex);
         git_reference* ref = nullptr;
         git_object* head = nullptr;
         git_commit* commit = nullptr;
@@ -241,6 +267,10 @@ namespace copypasta {
     void LibGit::setSignature(const std::string& username, const std::string& email) {
         this->username = username;
         this->email = email;
+        if (signature) {
+            git_signature_free(signature);
+            signature = nullptr;
+        }
         if (git_signature_new(&signature, username.c_str(), email.c_str(), time(nullptr), 0) < 0) {
             throw std::runtime_error("Failed to set signature");
         }
@@ -250,7 +280,7 @@ namespace copypasta {
         git_index* index = nullptr;
         int err = 0;
 
-        std::lock_guard<std::mutex> lock(gitMutex);
+        std::lock_guard<std::mutex> lock(*gitMutex);
 
         err = git_repository_index(&index, repo.get());
         err = git_index_read(index, 0);
@@ -283,7 +313,7 @@ namespace copypasta {
         int err;
         err = git_revparse_single(&target, repo.get(), "HEAD");
 
-        std::lock_guard<std::mutex> lock(gitMutex);
+        std::lock_guard<std::mutex> lock(*gitMutex);
         git_checkout_options opts = GIT_CHECKOUT_OPTIONS_INIT;
         err = git_reset(repo.get(), target, opt, &opts);
         git_object_free(target);
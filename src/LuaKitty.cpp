@@ -16,10 +16,14 @@ namespace copypasta{
 
   using namespace luabridge;
 
-  LuaExecutor::LuaExecutor():pool(1){
+  LuaExecutor::LuaExecutor():pool(1), background(1){
     L = luaL_newstate();
     luaL_openlibs(L);
     bind();
+    // patterns compiled by earlier runs, JIT runs in the background
+    if (PcreCache::global().load() > 0) {
+      PcreCache::global().jitAll(background);
+    }
   }
 
   LuaExecutor::~LuaExecutor() {
@@ -36,8 +40,52 @@ namespace copypasta{
     updateLuaArgs();
   }
 
+  namespace {
+    // end of every run, also when the script fails to load or errors out,
+    // so saves are made durable and the next run starts clean
+    struct RunEnd {
+      ThreadPool& background;
+
+      ~RunEnd() {
+        try {
+          // scripts usually run until killed, so persist after every run
+          PcreCache::global().save();
+
+          // one sync for everything the run saved
+          SaveBatch::global().flush();
+          SaveStats saves = SaveBatch::global().stats();
+          if (saves.saved + saves.skipped + saves.failed > 0) {
+            INFO("LuaExecutor saved - " << saves.saved << " skipped unchanged - " << saves.skipped
+                 << " failed - " << saves.failed);
+          }
+          SaveBatch::global().reset();
+
+          ParseStats parses = ParseControl::global().stats();
+          if (parses.timedOut + parses.cancelled > 0) {
+            WARN("LuaExecutor parses timed out - " << parses.timedOut << " cancelled - " << parses.cancelled);
+            for (auto& f : parses.files) {
+              WARN("  not parsed - " << f);
+            }
+          }
+          ParseControl::global().reset();
+
+          // nothing holds cached patterns between runs, free what the budgets
+          // evicted and no later eviction freed, once the background JIT is done
+          CacheEpoch::offline();
+          background.waitUntilFinished();
+          PcreCache::global().collect();
+          TSQueryCache::global().collect();
+        } catch (const std::exception& e) {
+          LERROR("LuaExecutor end of run failed - " << e.what());
+        }
+      }
+    };
+  }
+
   void LuaExecutor::exec(std::string pathOrChunk, bool fromFile){
 
+    RunEnd runEnd{ background };
+
     lua_getglobal(L, "debug");
     lua_getfield(L, -1, "traceback");
     lua_remove(L, -2);
@@ -191,23 +239,26 @@ namespace copypasta{
       return match;
     }
 
+    LuaRef hitToCap(lua_State* L, FileReader* r, const FileReader::MatchResult& hit){
+      auto sv = r->get(hit.match.start_byte, hit.match.end_byte);
+      LuaRef match  = LKHelpers::rangeToCap(L, hit.match);
+      match["path"] = r->getFile().pathStr;
+      match["text"] = std::string(sv.data(), sv.size());
+      LuaRef captures = newTable(L);
+      for(int i = 0; i< hit.captures.size(); i++){
+        LuaRef capture = LKHelpers::rangeToCap(L, hit.captures[i]); // Lua is 1 based;
+        auto sv = r->get(hit.captures[i].start_byte, hit.captures[i].end_byte);
+        capture["text"] = std::string(sv.data(), sv.size());
+        captures[i+1] = capture;
+      }
+      match["captures"] = captures;
+      return match;
+    }
+
     LuaRef matchToCap(lua_State* L, FileReader* r, std::vector<FileReader::MatchResult> matches){
       LuaRef table = newTable(L);
       for (size_t i = 0; i < matches.size(); ++i) {
-        auto hit = matches[i];
-        auto sv = r->get(hit.match.start_byte, hit.match.end_byte);
-        LuaRef match  = LKHelpers::rangeToCap(L, matches[i].match);
-        match["path"] = r->getFile().pathStr;
-        match["text"] = std::string(sv.data(), sv.size());
-        LuaRef captures = newTable(L);
-        for(int i = 0; i< hit.captures.size(); i++){
-          LuaRef capture = LKHelpers::rangeToCap(L, hit.captures[i]); // Lua is 1 based;
-          auto sv = r->get(hit.captures[i].start_byte, hit.captures[i].end_byte);
-          capture["text"] = std::string(sv.data(), sv.size());
-          captures[i+1] = capture;
-        }
-        match["captures"] = captures;
-        table[i + 1] = match; // Lua is 1 based
+        table[i + 1] = hitToCap(L, r, matches[i]); // Lua is 1 based
       }
       return table;
     }
@@ -218,7 +269,8 @@ namespace copypasta{
         const auto& e = errs[i];
         LuaRef err = newTable(L);
         err["type"] = (e.e == FileEditor::CONFLICT) ? "CONFLICT"
-                    : (e.e == FileEditor::CST_ERROR ? "CST_ERROR" : "CST_MISSING");
+                    : e.e == FileEditor::CST_ERROR ? "CST_ERROR"
+                    : e.e == FileEditor::CST_UNPARSED ? "CST_UNPARSED" : "CST_MISSING";
         err["startRow"] = e.range.start_point.row;
         err["startCol"] = e.range.start_point.column;
         err["endRow"] = e.range.end_point.row;
@@ -255,6 +307,19 @@ namespace copypasta{
       return cap;
     }
 
+    // { captureName = capture } of one query match
+    LuaRef matchToCaptures(lua_State* L, CSTTree* t, TSQuery* query, const TSQueryMatch& match) {
+      LuaRef captures = newTable(L);
+      for (uint32_t i = 0; i < match.capture_count; ++i) {
+        TSNode node = match.captures[i].node;
+        uint32_t nameLen = 0;
+        const char* name = ts_query_capture_name_for_id(query, match.captures[i].index, &nameLen);
+        LuaRef cap = makeCapture(L, node, t->getSource(), query, match.captures[i].index);
+        captures[std::string(name, nameLen)] = cap;
+      }
+      return captures;
+    }
+
     std::string luaRefToString(lua_State* L, luabridge::LuaRef v) {
     
       if (v.isNil()) return "nil";
@@ -382,6 +447,10 @@ namespace copypasta{
         .addData("isValid", &File::isValid)
         .addData("size", &File::size)
         .addData("level", &File::level)
+        // "unknown" unless the walk or a reader classified the file
+        .addProperty("kind", +[](const File* f) {
+          return std::string(ContentClassifier::name(f->kind));
+        })
         .addFunction("sync", &File::sync)
       .endClass()
       .addFunction("deleteFile", &File::deleteFile)
@@ -400,6 +469,9 @@ namespace copypasta{
 
         .addFunction("isValid", &FileReader::isValid)
         .addFunction("sync", &FileReader::sync)
+        .addFunction("kind", +[](FileReader* r) {
+          return std::string(ContentClassifier::name(r->classify()));
+        })
 
         .addFunction("get", +[](FileReader* r) {
           auto sv = r->get();
@@ -420,18 +492,41 @@ namespace copypasta{
           return r->getIndent(row);
         })
 
+        // large files are split over the cores, smaller ones searched here
         .addFunction("find", +[](FileReader* r, const std::string& pattern, bool regex, lua_State* L) {
-          auto results = r->find(pattern, regex);
+          static ThreadPool searchPool;
+          auto results = r->find(searchPool, pattern, regex);
           return LKHelpers::matchToCap(L, r, results);
         })
+        // callback gets one match at a time, return false from it to stop;
+        // stays sequential so a stop ends the search instead of a parallel scan
+        .addFunction("findEach", +[](FileReader* r, const std::string& pattern, bool regex, LuaRef callback) {
+          lua_State* L = callback.state();
+          return r->findEach(pattern, [r, L, &callback](const FileReader::MatchView& view) {
+            LuaRef res = callback(LKHelpers::hitToCap(L, r, r->toMatchResult(view)));
+            return !(res.isBool() && !res.cast<bool>());
+          }, regex);
+        })
+        .addFunction("findFirst", +[](FileReader* r, const std::string& pattern, bool regex, lua_State* L) -> LuaRef {
+          auto first = r->findFirst(pattern, regex);
+          if (!first) return LuaRef(L);
+          return LKHelpers::hitToCap(L, r, *first);
+        })
+        .addFunction("exists", +[](FileReader* r, const std::string& pattern, bool regex) {
+          return r->exists(pattern, regex);
+        })
+        .addFunction("count", +[](FileReader* r, const std::string& pattern, bool regex) {
+          return r->count(pattern, regex);
+        })
       .endClass()
+      // LuaBridge copies returned values into userdata, the copy shares the buffer
       .addFunction("read", +[](const std::string& path) {
          return FileReader(path);
       })
       .addFunction("readSnap", +[](const std::string& cont) {
          FileSnapshot s;
          s.cont = cont;
-         return FileReader(cont);
+         return FileReader(std::move(s));
       });
   }
 
@@ -466,6 +561,17 @@ namespace copypasta{
      .endClass()
      .addFunction("write", +[](const std::string& path){
        return FileWriter(path);
+     })
+     // edits are {startByte, endByte, text}, the file is never loaded
+     .addFunction("rewrite", +[](const std::string& path, LuaRef edits, LuaRef target){
+       std::vector<TextEdit> batch;
+       for (auto it : pairs(edits)) {
+         LuaRef e = it.second;
+         batch.push_back({ e["startByte"].cast<size_t>(), e["endByte"].cast<size_t>(),
+                           e["text"].isNil() ? std::string() : e["text"].cast<std::string>() });
+       }
+       FileWriter::rewrite(path, std::move(batch),
+                           target.isString() ? target.cast<std::string>() : std::string());
      });
   }
 
@@ -479,6 +585,11 @@ namespace copypasta{
       walker.inverted = opts["inverted"].cast<bool>();
       walker.filesOnly = opts["filesOnly"].cast<bool>();
       walker.obeyGitIgnore = !opts["doNotObeyGitIgnore"].cast<bool>();
+      if (opts["textOnly"].cast<bool>()) {
+        walker.content = DirWalker::TEXT_ONLY;
+      } else if (opts["classify"].cast<bool>()) {
+        walker.content = DirWalker::MARK;
+      }
 
       
       // TODO: thread pool
@@ -498,6 +609,9 @@ namespace copypasta{
 
       walker.walk([&callback](DirWalker::STATUS status, File file, LibGit& git) {
         LuaRef result = callback(&file, &git);
+        // scripts hold no cache pointers between files, patterns evicted
+        // while the callback ran can be freed from here on
+        CacheEpoch::offline();
         if (result.isNumber()) {
           int rv = result.cast<int>();
           if (rv == (int)DirWalker::STOP) return DirWalker::STOP;
@@ -560,16 +674,25 @@ namespace copypasta{
     Namespace ns = getGlobalNamespace(L);
 
     ns.beginClass<TSLangWrapper>("Language")
-        .addFunction("parse", +[](TSLangWrapper* lang, const std::string& input){
-          std::string source;
+        // nil when the parse ran out of time or the run was cancelled,
+        // the script falls back to regex or skips the file
+        .addFunction("parse", +[](TSLangWrapper* lang, const std::string& input, lua_State* L){
           assert(!input.empty());
-          return TSEnginePool::global().get(lang->getLang()->getRaw())->parse(input);
+          try {
+            // the tree keeps its own copy, input dies with this call
+            return LuaRef(L, TSEnginePool::global().get(lang->getLang()->getRaw())->parse(SharedText(input)));
+          } catch (const ParseAborted&) {
+            return LuaRef(L);
+          }
         })
-        .addFunction("parseFile", +[](TSLangWrapper* lang, const std::string& path){
-          std::string source;
+        .addFunction("parseFile", +[](TSLangWrapper* lang, const std::string& path, lua_State* L){
           assert(!path.empty());
           FileReader reader(path);
-          return TSEnginePool::global().get(lang->getLang()->getRaw())->parse(reader);
+          try {
+            return LuaRef(L, TSEnginePool::global().get(lang->getLang()->getRaw())->parse(reader));
+          } catch (const ParseAborted&) {
+            return LuaRef(L);
+          }
         })
         .addFunction("getNodeTypes", +[](TSLangWrapper* lang, lua_State* L){
             auto eng = TSEnginePool::global().get(lang->getLang()->getRaw());
@@ -599,9 +722,16 @@ namespace copypasta{
     ns.beginClass<CSTTree>("Tree")
       .addFunction("sexp", &CSTTree:: asSexpr)
       .addFunction("asQuery", &CSTTree::asQuery)
+      .addFunction("setDeferred", &CSTTree::setDeferred)
+      .addFunction("isDeferred", &CSTTree::isDeferred)
+      .addFunction("pending", +[](CSTTree* t) { return (int)t->pending(); })
+      .addFunction("flush", &CSTTree::flush)
+      .addFunction("hasErrors", &CSTTree::hasErrors)
       .addFunction("getErrors", +[](CSTTree* t, lua_State* L){
-        auto errors = t->getErrors();
         LuaRef res = newTable(L);
+        if (!t->hasErrors())
+          return res;
+        auto errors = t->getErrors();
         for(int i = 0; i < errors.size(); i++){
           res[i+1] = LKHelpers::rangeToCap(L, errors[i]);
         } 
@@ -610,17 +740,113 @@ namespace copypasta{
       .addFunction("query", +[](CSTTree* t, const std::string& expr, LuaRef callback) {
         lua_State* L = callback.state();
         auto parent = t->getParent();
-        TSQuery* query = TSQueryCache::global().get(parent, expr);
-        t->find(query, [t, query, callback, L](TSQueryMatch match){
-          LuaRef captures = newTable(L);
-          for (uint32_t i = 0; i < match.capture_count; ++i) {
-            TSNode node = match.captures[i].node;
-            uint32_t nameLen = 0;
-            const char* name = ts_query_capture_name_for_id(query, match.captures[i].index, &nameLen);
-            LuaRef cap = LKHelpers::makeCapture(L, node, t->getSource(), query, match.captures[i].index);
-            captures[std::string(name, nameLen)] = cap;
-          }
-          callback(captures);
+        auto& compiled = TSQueryCache::global().entry(parent, expr);
+        TSQuery* query = compiled.query;
+        // #eq?, #match? and #any-of? are checked before the callback runs
+        t->find(query, compiled.predicates, [t, query, callback, L](TSQueryMatch match){
+          callback(LKHelpers::matchToCaptures(L, t, query, match));
+        });
+      })
+      // query split over the cores for very large files, the callback still
+      // runs on this thread with matches in the order query gives them
+      .addFunction("queryParallel", +[](CSTTree* t, const std::string& expr, LuaRef callback) {
+        static ThreadPool queryPool;
+        lua_State* L = callback.state();
+        auto& compiled = TSQueryCache::global().entry(t->getParent(), expr);
+        TSQuery* query = compiled.query;
+        t->findParallel(queryPool, query, compiled.predicates, [t, query, callback, L](TSQueryMatch match){
+          callback(LKHelpers::matchToCaptures(L, t, query, match));
+        });
+      })
+      // only within scope, a capture or { startByte, endByte } or { row, endRow },
+      // so a query run from another query's callback does not rescan the file
+      .addFunction("queryIn", +[](CSTTree* t, LuaRef scope, const std::string& expr, LuaRef callback) {
+        lua_State* L = callback.state();
+        auto& compiled = TSQueryCache::global().entry(t->getParent(), expr);
+        TSQuery* query = compiled.query;
+        auto handle = [t, query, callback, L](TSQueryMatch match){
+          callback(LKHelpers::matchToCaptures(L, t, query, match));
+        };
+        if (scope["startByte"].isNil()) {
+          TSPoint start = { scope["row"].cast<uint32_t>(),
+                            scope["col"].isNil() ? 0 : scope["col"].cast<uint32_t>() };
+          TSPoint end = { scope["endRow"].cast<uint32_t>(),
+                          scope["endCol"].isNil() ? 0 : scope["endCol"].cast<uint32_t>() };
+          t->find(query, compiled.predicates, start, end, handle);
+          return;
+        }
+        uint32_t sb = scope["startByte"].cast<uint32_t>();
+        uint32_t eb = scope["endByte"].cast<uint32_t>();
+        TSNode root = ts_tree_root_node(t->getRawTree());
+        TSNode node = ts_node_descendant_for_byte_range(root, sb, eb);
+        if (!ts_node_is_null(node) && ts_node_start_byte(node) == sb && ts_node_end_byte(node) == eb) {
+          t->find(query, compiled.predicates, node, handle);
+          return;
+        }
+        t->find(query, compiled.predicates, sb, eb, handle);
+      })
+      // { name = expr, ... } in one pass over the tree, each match goes to
+      // handlers[name], matches of different queries arrive in document order
+      .addFunction("queryMany", +[](CSTTree* t, LuaRef queries, LuaRef handlers) {
+        lua_State* L = queries.state();
+        std::vector<std::pair<std::string, std::string>> named;
+        for (auto it : pairs(queries)) {
+          named.emplace_back(it.first.cast<std::string>(), it.second.cast<std::string>());
+        }
+        // pairs() order varies, sorted names give the same combined query every time
+        std::sort(named.begin(), named.end());
+        std::vector<std::string> exprs;
+        std::vector<LuaRef> callbacks;
+        for (auto& [name, expr] : named) {
+          exprs.push_back(expr);
+          callbacks.push_back(handlers[name]);
+        }
+        auto combined = TSQueryCache::global().combine(t->getParent(), exprs);
+        TSQuery* query = combined.entry->query;
+        t->findMany(query, combined.entry->predicates, combined.owner,
+          [t, query, &callbacks, L](uint32_t which, TSQueryMatch match) {
+            if (!callbacks[which].isFunction())
+              return;
+            callbacks[which](LKHelpers::matchToCaptures(L, t, query, match));
+          });
+      })
+      // lang parsed only inside the nodes hostExpr captures, HQL in string
+      // literals or SQL in CDATA. opts { capture = name, combined = bool },
+      // nil when a guest parse ran out of time
+      .addFunction("inject", +[](CSTTree* t, TSLangWrapper* lang, const std::string& hostExpr,
+                                 LuaRef opts, lua_State* L) {
+        auto& host = TSQueryCache::global().entry(t->getParent(), hostExpr);
+        bool hasOpts = opts.isTable();
+        std::string capture = hasOpts && opts["capture"].isString() ? opts["capture"].cast<std::string>() : "";
+        bool combined = hasOpts && opts["combined"].isBool() && opts["combined"].cast<bool>();
+        auto ranges = t->captureRanges(host.query, host.predicates, capture);
+        auto guest = TSEnginePool::global().get(lang->getLang()->getRaw());
+        try {
+          return LuaRef(L, guest->inject(*t, std::move(ranges), combined));
+        } catch (const ParseAborted&) {
+          return LuaRef(L);
+        }
+      })
+    .endClass();
+
+    // captures keep host offsets, ranges from a callback go straight to an Editor
+    ns.beginClass<InjectedLayer>("Injection")
+      .addFunction("size", +[](InjectedLayer* l) { return (int)l->size(); })
+      .addFunction("hasErrors", &InjectedLayer::hasErrors)
+      .addFunction("getErrors", +[](InjectedLayer* l, lua_State* L){
+        LuaRef res = newTable(L);
+        auto errors = l->getErrors();
+        for(int i = 0; i < errors.size(); i++){
+          res[i+1] = LKHelpers::rangeToCap(L, errors[i]);
+        }
+        return res;
+      })
+      .addFunction("query", +[](InjectedLayer* l, const std::string& expr, LuaRef callback) {
+        lua_State* L = callback.state();
+        auto& compiled = TSQueryCache::global().entry(l->getParent(), expr);
+        TSQuery* query = compiled.query;
+        l->findWithTree(query, compiled.predicates, [query, callback, L](CSTTree& t, TSQueryMatch match){
+          callback(LKHelpers::matchToCaptures(L, &t, query, match));
         });
       })
     .endClass();
@@ -984,6 +1210,83 @@ namespace copypasta{
         return std::string(s.rbegin(), s.rend());
       })
       .endNamespace() // String
+
+      .beginNamespace("Cache")
+        .addFunction("stats", +[](lua_State* L) {
+          auto toTable = [L](const CacheStats& st) {
+            LuaRef t = newTable(L);
+            t["hits"] = st.hits;
+            t["misses"] = st.misses;
+            t["evictions"] = st.evictions;
+            t["entries"] = st.entries;
+            t["bytes"] = st.bytes;
+            t["budget"] = st.budget;
+            return t;
+          };
+          LuaRef res = newTable(L);
+          res["pcre"] = toTable(PcreCache::global().stats());
+          res["query"] = toTable(TSQueryCache::global().stats());
+          return res;
+        })
+        .addFunction("setPcreBudget", +[](size_t bytes) {
+          PcreCache::global().setBudget(bytes);
+        })
+        .addFunction("setQueryBudget", +[](size_t bytes) {
+          TSQueryCache::global().setBudget(bytes);
+        })
+      .endNamespace() // Cache
+
+      .beginNamespace("Content")
+        .addFunction("classify", +[](const std::string& path) {
+          return std::string(ContentClassifier::name(ContentClassifier::global().classify(path)));
+        })
+        .addFunction("addGeneratedMarker", +[](const std::string& marker) {
+          ContentClassifier::global().generatedMarkers.push_back(marker);
+        })
+        .addFunction("setMaxLineLength", +[](size_t len) {
+          ContentClassifier::global().maxLineLength = len;
+        })
+        .addFunction("setSampleSize", +[](size_t bytes) {
+          ContentClassifier::global().sampleSize = bytes;
+        })
+      .endNamespace() // Content
+
+      .beginNamespace("Save")
+        .addFunction("stats", +[](lua_State* L) {
+          SaveStats st = SaveBatch::global().stats();
+          LuaRef res = newTable(L);
+          res["saved"] = st.saved;
+          res["skipped"] = st.skipped;
+          res["failed"] = st.failed;
+          return res;
+        })
+        .addFunction("flush", +[]() {
+          return SaveBatch::global().flush();
+        })
+      .endNamespace() // Save
+
+      .beginNamespace("Parse")
+        // per parse budget in milliseconds, 0 for none
+        .addFunction("setTimeout", +[](double ms) {
+          ParseControl::global().setBudget((uint64_t)(ms * 1000));
+        })
+        // every parse until the run ends
+        .addFunction("cancel", +[]() {
+          ParseControl::global().cancel();
+        })
+        .addFunction("stats", +[](lua_State* L) {
+          ParseStats st = ParseControl::global().stats();
+          LuaRef res = newTable(L);
+          res["timedOut"] = st.timedOut;
+          res["cancelled"] = st.cancelled;
+          LuaRef files = newTable(L);
+          for (size_t i = 0; i < st.files.size(); i++) {
+            files[i + 1] = st.files[i];
+          }
+          res["files"] = files;
+          return res;
+        })
+      .endNamespace() // Parse
     .endNamespace(); // Helper
   }
 } // namespace copypasta
@@ -0,0 +1,293 @@
+#include <PieceTable.hpp>
+#include <Logger.hpp>
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace copypasta {
+
+    namespace {
+        uint32_t nextPrio() {
+            // xorshift, treap priorities only need to be well spread
+            static thread_local uint32_t state = 0x9e3779b9u
+                ^ (uint32_t)std::hash<const void*>{}(&state);
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            return state;
+        }
+    }
+
+    PieceTable::PieceTable(std::string content) {
+        assign(std::move(content));
+    }
+
+    PieceTable::NodePtr PieceTable::make(const Piece& piece, NodePtr left, NodePtr right, uint32_t prio) {
+        size_t size = sizeOf(left) + piece.len + sizeOf(right);
+        return std::make_shared<const Node>(Node{ piece, std::move(left), std::move(right), size, prio });
+    }
+
+    // nodes are never mutated, both operations copy the path they walk
+    PieceTable::NodePtr PieceTable::merge(const NodePtr& a, const NodePtr& b) {
+        if (!a)
+            return b;
+        if (!b)
+            return a;
+        if (a->prio > b->prio)
+            return make(a->piece, a->left, merge(a->right, b), a->prio);
+        return make(b->piece, merge(a, b->left), b->right, b->prio);
+    }
+
+    // n by value, callers split a subtree into its own variable
+    void PieceTable::split(NodePtr n, size_t at, NodePtr& left, NodePtr& right) {
+        if (!n) {
+            left = right = nullptr;
+            return;
+        }
+        size_t leftSize = sizeOf(n->left);
+        if (at <= leftSize) {
+            NodePtr l, r;
+            split(n->left, at, l, r);
+            left = l;
+            right = make(n->piece, r, n->right, n->prio);
+            return;
+        }
+        size_t pieceEnd = leftSize + n->piece.len;
+        if (at >= pieceEnd) {
+            NodePtr l, r;
+            split(n->right, at - pieceEnd, l, r);
+            left = make(n->piece, n->left, l, n->prio);
+            right = r;
+            return;
+        }
+        // inside the piece, both halves keep pointing into the same buffer
+        size_t cut = at - leftSize;
+        Piece head{ n->piece.buf, n->piece.start, cut };
+        Piece tail{ n->piece.buf, n->piece.start + cut, n->piece.len - cut };
+        left = make(head, n->left, nullptr, n->prio);
+        right = make(tail, nullptr, n->right, n->prio);
+    }
+
+    void PieceTable::chunk(const std::shared_ptr<const std::string>& buf, std::vector<Piece>& into) {
+        for (size_t start = 0; start < buf->size(); start += maxPieceSize) {
+            into.push_back({ buf, start, std::min(maxPieceSize, buf->size() - start) });
+        }
+    }
+
+    // balanced over pieces [lo, hi), a parent takes the max priority of its
+    // children so the heap order holds without merging piece by piece
+    PieceTable::NodePtr PieceTable::build(const std::vector<Piece>& pieces, size_t lo, size_t hi) {
+        if (lo >= hi)
+            return nullptr;
+        size_t mid = lo + (hi - lo) / 2;
+        NodePtr left = build(pieces, lo, mid);
+        NodePtr right = build(pieces, mid + 1, hi);
+        uint32_t prio = std::max({ nextPrio(), left ? left->prio : 0u, right ? right->prio : 0u });
+        return make(pieces[mid], std::move(left), std::move(right), prio);
+    }
+
+    PieceTable::NodePtr PieceTable::build(std::shared_ptr<const std::string> buf) {
+        std::vector<Piece> pieces;
+        chunk(buf, pieces);
+        return build(pieces, 0, pieces.size());
+    }
+
+    void PieceTable::collect(const Node* n, std::vector<Piece>& into) {
+        if (n == nullptr)
+            return;
+        collect(n->left.get(), into);
+        into.push_back(n->piece);
+        collect(n->right.get(), into);
+    }
+
+    void PieceTable::assign(std::string content) {
+        assign(SharedText(std::move(content)));
+    }
+
+    void PieceTable::assign(const SharedText& content) {
+        root = content.empty() ? nullptr : build(content.share());
+        flat = content; // already contiguous, flatten() is free until the next edit
+    }
+
+    SharedText PieceTable::flatten() const {
+        if (!flat.share()) {
+            DEBUG("PieceTable flatten - " << size());
+            flat = SharedText(str());
+        }
+        return flat;
+    }
+
+    void PieceTable::insert(size_t offset, std::string_view text) {
+        if (offset > size())
+            throw std::out_of_range("PieceTable insert past end - " + std::to_string(offset));
+        if (text.empty())
+            return;
+        DEBUG_FULL("PieceTable insert at - " << offset << " len - " << text.size());
+        flat = SharedText();
+        NodePtr left, right;
+        split(root, offset, left, right);
+        root = merge(merge(left, build(std::make_shared<std::string>(text))), right);
+    }
+
+    void PieceTable::erase(size_t from, size_t to) {
+        to = std::min(to, size());
+        if (from >= to)
+            return;
+        DEBUG_FULL("PieceTable erase " << from << " to " << to);
+        flat = SharedText();
+        NodePtr left, mid, right;
+        split(root, from, left, mid);
+        split(mid, to - from, mid, right);
+        root = merge(left, right);
+    }
+
+    void PieceTable::replace(size_t from, size_t to, std::string_view text) {
+        if (from > size())
+            throw std::out_of_range("PieceTable replace past end - " + std::to_string(from));
+        to = std::max(from, std::min(to, size()));
+        if (from == to && text.empty())
+            return;
+        flat = SharedText();
+        NodePtr left, mid, right;
+        split(root, from, left, mid);
+        split(mid, to - from, mid, right);
+        if (!text.empty())
+            left = merge(left, build(std::make_shared<std::string>(text)));
+        root = merge(left, right);
+    }
+
+    void PieceTable::splice(const std::vector<Splice>& sorted) {
+        if (sorted.empty())
+            return;
+        DEBUG("PieceTable splice - " << sorted.size());
+        flat = SharedText();
+
+        std::vector<Piece> old;
+        collect(root.get(), old);
+
+        // every replacement goes into one buffer
+        size_t total = 0;
+        for (auto& sp : sorted)
+            total += sp.text.size();
+        std::string joined;
+        joined.reserve(total);
+        for (auto& sp : sorted)
+            joined.append(sp.text);
+        auto added = std::make_shared<std::string>(std::move(joined));
+
+        std::vector<Piece> pieces;
+        pieces.reserve(old.size() + sorted.size() * 2);
+        size_t pieceIdx = 0;
+        size_t pieceStart = 0; // offset of old[pieceIdx]
+        size_t pos = 0;        // old bytes consumed so far
+        size_t addedPos = 0;
+
+        // emits old bytes [pos, to)
+        auto keepUntil = [&](size_t to) {
+            while (pos < to && pieceIdx < old.size()) {
+                const Piece& p = old[pieceIdx];
+                size_t pieceEnd = pieceStart + p.len;
+                size_t end = std::min(to, pieceEnd);
+                pieces.push_back({ p.buf, p.start + (pos - pieceStart), end - pos });
+                pos = end;
+                if (pos == pieceEnd) {
+                    pieceStart = pieceEnd;
+                    pieceIdx++;
+                }
+            }
+        };
+        // drops old bytes [pos, to)
+        auto skipUntil = [&](size_t to) {
+            while (pos < to && pieceIdx < old.size()) {
+                size_t pieceEnd = pieceStart + old[pieceIdx].len;
+                pos = std::min(to, pieceEnd);
+                if (pos == pieceEnd) {
+                    pieceStart = pieceEnd;
+                    pieceIdx++;
+                }
+            }
+        };
+
+        for (auto& sp : sorted) {
+            if (sp.from < pos || sp.to < sp.from || sp.to > size())
+                throw std::invalid_argument("PieceTable splice unsorted or overlapping at - " + std::to_string(sp.from));
+            keepUntil(sp.from);
+            skipUntil(sp.to);
+            for (size_t start = 0; start < sp.text.size(); start += maxPieceSize) {
+                pieces.push_back({ added, addedPos + start, std::min(maxPieceSize, sp.text.size() - start) });
+            }
+            addedPos += sp.text.size();
+        }
+        keepUntil(size());
+
+        root = build(pieces, 0, pieces.size());
+    }
+
+    std::string_view PieceTable::chunkAt(size_t offset) const {
+        const Node* n = root.get();
+        while (n != nullptr) {
+            size_t leftSize = sizeOf(n->left);
+            if (offset < leftSize) {
+                n = n->left.get();
+                continue;
+            }
+            offset -= leftSize;
+            if (offset < n->piece.len)
+                return n->piece.view().substr(offset);
+            offset -= n->piece.len;
+            n = n->right.get();
+        }
+        return std::string_view();
+    }
+
+    char PieceTable::at(size_t offset) const {
+        auto chunk = chunkAt(offset);
+        if (chunk.empty())
+            throw std::out_of_range("PieceTable at past end - " + std::to_string(offset));
+        return chunk[0];
+    }
+
+    std::string PieceTable::substr(size_t from, size_t len) const {
+        std::string res;
+        if (from >= size())
+            return res;
+        size_t to = len > size() - from ? size() : from + len;
+        res.reserve(to - from);
+        forEachChunk(from, to, [&res](std::string_view chunk) {
+            res.append(chunk);
+            return true;
+            });
+        return res;
+    }
+
+    std::string PieceTable::str() const {
+        if (!empty())
+            SharedText::countCopy();
+        return substr(0);
+    }
+
+    bool PieceTable::writeTo(std::ostream& os) const {
+        forEachChunk([&os](std::string_view chunk) {
+            os.write(chunk.data(), chunk.size());
+            return os.good();
+            });
+        return os.good();
+    }
+
+    const char* PieceTable::tsRead(void* payload, uint32_t byte_index, TSPoint point,
+        uint32_t* bytes_read) {
+        auto table = static_cast<const PieceTable*>(payload);
+        auto chunk = table->chunkAt(byte_index);
+        *bytes_read = (uint32_t)chunk.size();
+        return chunk.empty() ? "" : chunk.data();
+    }
+
+    TSInput PieceTable::asTsInput() const {
+        TSInput input{};
+        input.payload = const_cast<PieceTable*>(this);
+        input.read = &PieceTable::tsRead;
+        input.encoding = TSInputEncodingUTF8;
+        return input;
+    }
+
+} // namespace copypasta
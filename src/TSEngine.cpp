@@ -2,7 +2,335 @@
 #include <Logger.hpp>
 #include <CacheAndPool.hpp>
 
+#include <algorithm>
+#include <chrono>
+#include <list>
+#include <set>
+#include <unordered_map>
+
 namespace copypasta {
+
+    namespace {
+        // the adjustment ts_tree_edit applies to positions past the edit
+        TSPoint shiftPoint(TSPoint p, const TSInputEdit& ed) {
+            if (p.row == ed.old_end_point.row)
+                return { ed.new_end_point.row, ed.new_end_point.column + (p.column - ed.old_end_point.column) };
+            return { ed.new_end_point.row + (p.row - ed.old_end_point.row), p.column };
+        }
+
+        // keeps a recorded range on the same text after ed, a range the edit
+        // cuts into grows to cover the new text
+        void shiftRange(TSRange& r, const TSInputEdit& ed) {
+            if (r.end_byte < ed.start_byte)
+                return;
+            if (r.start_byte >= ed.old_end_byte) {
+                r.start_byte = r.start_byte - ed.old_end_byte + ed.new_end_byte;
+                r.start_point = shiftPoint(r.start_point, ed);
+            }
+            else if (r.start_byte > ed.start_byte) {
+                r.start_byte = ed.start_byte;
+                r.start_point = ed.start_point;
+            }
+            if (r.end_byte >= ed.old_end_byte) {
+                r.end_byte = r.end_byte - ed.old_end_byte + ed.new_end_byte;
+                r.end_point = shiftPoint(r.end_point, ed);
+            }
+            else {
+                r.end_byte = ed.new_end_byte;
+                r.end_point = ed.new_end_point;
+            }
+        }
+
+        // ERROR and MISSING nodes touching [from, to] in document order, only
+        // descends into subtrees ts_node_has_error marks and that reach the range
+        void collectErrors(TSNode root, uint32_t from, uint32_t to,
+            std::vector<TSRange>& errors, std::set<const void*>* seen) {
+            TSTreeCursor cursor = ts_tree_cursor_new(root);
+            while (true) {
+                TSNode n = ts_tree_cursor_current_node(&cursor);
+                if (ts_node_start_byte(n) > to)
+                    break; // every node after this one starts later
+                bool inRange = ts_node_end_byte(n) >= from;
+                if (inRange && (ts_node_is_error(n) || ts_node_is_missing(n))
+                    && (seen == nullptr || seen->insert(n.id).second)) {
+                    errors.push_back(TSEngine::getRange(n));
+                }
+                if (inRange && ts_node_has_error(n) && ts_tree_cursor_goto_first_child(&cursor))
+                    continue;
+                bool next = false;
+                while (!(next = ts_tree_cursor_goto_next_sibling(&cursor))) {
+                    if (!ts_tree_cursor_goto_parent(&cursor))
+                        break;
+                }
+                if (!next)
+                    break;
+            }
+            ts_tree_cursor_delete(&cursor);
+        }
+
+        void mergeRanges(std::vector<TSRange>& ranges) {
+            if (ranges.size() < 2)
+                return;
+            std::sort(ranges.begin(), ranges.end(), [](const TSRange& a, const TSRange& b) {
+                return a.start_byte < b.start_byte;
+                });
+            size_t last = 0;
+            for (size_t i = 1; i < ranges.size(); i++) {
+                if (ranges[i].start_byte <= ranges[last].end_byte) {
+                    if (ranges[i].end_byte > ranges[last].end_byte) {
+                        ranges[last].end_byte = ranges[i].end_byte;
+                        ranges[last].end_point = ranges[i].end_point;
+                    }
+                    continue;
+                }
+                ranges[++last] = ranges[i];
+            }
+            ranges.resize(last + 1);
+        }
+
+        // ranges an injected tree was parsed within, shifted by every ts_tree_edit
+        std::vector<TSRange> includedRanges(const TSTree* tree) {
+            uint32_t count = 0;
+            TSRange* ranges = ts_tree_included_ranges(tree, &count);
+            std::vector<TSRange> res(ranges, ranges + count);
+            free(ranges);
+            return res;
+        }
+
+        // node starts at least target bytes apart, a node bigger than target
+        // is split at its children since a Java file is mostly one class body
+        std::vector<uint32_t> splitPoints(TSNode root, uint32_t target) {
+            std::vector<uint32_t> starts{ 0 };
+            TSTreeCursor cursor = ts_tree_cursor_new(root);
+            bool more = ts_tree_cursor_goto_first_child(&cursor);
+            while (more) {
+                TSNode node = ts_tree_cursor_current_node(&cursor);
+                uint32_t start = ts_node_start_byte(node);
+                if (start >= starts.back() + target)
+                    starts.push_back(start);
+                if (ts_node_end_byte(node) - start > target && ts_tree_cursor_goto_first_child(&cursor))
+                    continue;
+                while (!(more = ts_tree_cursor_goto_next_sibling(&cursor))) {
+                    if (!ts_tree_cursor_goto_parent(&cursor))
+                        break;
+                }
+            }
+            ts_tree_cursor_delete(&cursor);
+            return starts;
+        }
+
+        // the same pattern on the same nodes, copies of a tree share node ids
+        uint64_t matchKey(const TSQueryMatch& match) {
+            uint64_t h = match.pattern_index;
+            for (uint16_t i = 0; i < match.capture_count; i++) {
+                h = (h ^ (uint64_t)(uintptr_t)match.captures[i].node.id) * 0x100000001b3ull;
+                h = (h ^ match.captures[i].index) * 0x100000001b3ull;
+            }
+            return h;
+        }
+
+        bool sameMatch(const TSQueryMatch& a, const TSQueryMatch& b) {
+            if (a.pattern_index != b.pattern_index || a.capture_count != b.capture_count)
+                return false;
+            for (uint16_t i = 0; i < a.capture_count; i++) {
+                if (a.captures[i].index != b.captures[i].index || a.captures[i].node.id != b.captures[i].node.id)
+                    return false;
+            }
+            return true;
+        }
+
+        struct QueryJob {
+            std::vector<uint32_t> starts;
+            std::vector<std::vector<TSQueryMatch>> matches; // per chunk
+            std::vector<std::vector<TSQueryCapture>> captures;
+            std::vector<std::vector<uint64_t>> keys; // matchKey of each match
+            std::atomic<size_t> next{ 0 };
+            std::mutex mtx;
+            std::condition_variable finished;
+            size_t done = 0;
+            std::exception_ptr error;
+        };
+    }
+
+    //QueryCursor
+
+    namespace {
+        struct CursorPool {
+            std::vector<TSQueryCursor*> free;
+            ~CursorPool() {
+                for (auto c : free)
+                    ts_query_cursor_delete(c);
+            }
+        };
+        CursorPool& cursorPool() {
+            static thread_local CursorPool pool;
+            return pool;
+        }
+    }
+
+    QueryCursor::QueryCursor() {
+        auto& pool = cursorPool();
+        if (pool.free.empty()) {
+            DEBUG_FULL("QueryCursor new");
+            cursor = ts_query_cursor_new();
+            return;
+        }
+        cursor = pool.free.back();
+        pool.free.pop_back();
+    }
+
+    QueryCursor::~QueryCursor() {
+        // exec resets the match state but not the ranges
+        ts_query_cursor_set_byte_range(cursor, 0, UINT32_MAX);
+        ts_query_cursor_set_point_range(cursor, { 0, 0 }, { UINT32_MAX, UINT32_MAX });
+        cursorPool().free.push_back(cursor);
+    }
+
+    //QueryPredicates
+
+    namespace {
+        // one per thread, a yes or no match needs no groups
+        pcre2_match_data* predicateMatchData() {
+            static thread_local std::unique_ptr<pcre2_match_data, void(*)(pcre2_match_data*)>
+                md(pcre2_match_data_create(1, NULL), pcre2_match_data_free);
+            return md.get();
+        }
+    }
+
+    QueryPredicates::QueryPredicates(const TSQuery* query) {
+        if (query == nullptr)
+            return;
+        uint32_t patterns = ts_query_pattern_count(query);
+        byPattern.resize(patterns);
+        for (uint32_t i = 0; i < patterns; i++) {
+            uint32_t len = 0;
+            const TSQueryPredicateStep* steps = ts_query_predicates_for_pattern(query, i, &len);
+            uint32_t start = 0;
+            for (uint32_t j = 0; j < len; j++) {
+                if (steps[j].type != TSQueryPredicateStepTypeDone)
+                    continue;
+                const TSQueryPredicateStep* args = steps + start;
+                uint32_t argc = j - start;
+                start = j + 1;
+                if (argc < 2 || args[0].type != TSQueryPredicateStepTypeString)
+                    continue;
+
+                uint32_t nameLen = 0;
+                const char* raw = ts_query_string_value_for_id(query, args[0].value_id, &nameLen);
+                std::string_view name(raw, nameLen);
+                std::string_view full = name;
+
+                Predicate p;
+                if (name.substr(0, 4) == "any-" && name != "any-of?") {
+                    p.any = true;
+                    name.remove_prefix(4);
+                }
+                if (name.substr(0, 4) == "not-") {
+                    p.negate = true;
+                    name.remove_prefix(4);
+                }
+                if (name == "eq?")
+                    p.kind = EQ;
+                else if (name == "match?")
+                    p.kind = MATCH;
+                else if (name == "any-of?")
+                    p.kind = ANY_OF;
+                else {
+                    DEBUG("QueryPredicates ignoring #" << full);
+                    continue;
+                }
+
+                if (args[1].type != TSQueryPredicateStepTypeCapture
+                    || (p.kind != ANY_OF && argc != 3)) {
+                    WARN("QueryPredicates malformed #" << full << " in pattern " << i << ", ignored");
+                    continue;
+                }
+                p.capture = args[1].value_id;
+                for (uint32_t k = 2; k < argc; k++) {
+                    if (args[k].type == TSQueryPredicateStepTypeCapture && p.kind == EQ) {
+                        p.otherCapture = args[k].value_id;
+                        continue;
+                    }
+                    uint32_t valueLen = 0;
+                    const char* value = ts_query_string_value_for_id(query, args[k].value_id, &valueLen);
+                    p.values.emplace_back(value, valueLen);
+                }
+                if (p.kind == MATCH) {
+                    if (p.values.empty()) {
+                        WARN("QueryPredicates #" << full << " needs a string, ignored");
+                        continue;
+                    }
+                    p.patternHash = PcreCache::hashPattern(p.values[0]);
+                    PcreCache::global().get(p.values[0], 0, p.patternHash); // compile errors show up here
+                }
+                byPattern[i].push_back(std::move(p));
+                none = false;
+            }
+        }
+    }
+
+    bool QueryPredicates::holds(const Predicate& p, const TSQueryMatch& match, CSTTree& tree) {
+        if (p.otherCapture != UINT32_MAX) {
+            // like tree-sitter, the first node of each capture is compared
+            const TSNode* a = nullptr;
+            const TSNode* b = nullptr;
+            for (uint16_t i = 0; i < match.capture_count; i++) {
+                if (a == nullptr && match.captures[i].index == p.capture)
+                    a = &match.captures[i].node;
+                if (b == nullptr && match.captures[i].index == p.otherCapture)
+                    b = &match.captures[i].node;
+            }
+            if (a == nullptr || b == nullptr)
+                return true;
+            return (tree.getText(*a) == tree.getText(*b)) != p.negate;
+        }
+
+        bool seen = false;
+        for (uint16_t i = 0; i < match.capture_count; i++) {
+            if (match.captures[i].index != p.capture)
+                continue;
+            TSNode n = match.captures[i].node;
+            bool ok = false;
+            switch (p.kind) {
+            case EQ:
+                ok = tree.textEquals(n, p.values.empty() ? std::string_view() : p.values[0]);
+                break;
+            case ANY_OF:
+                for (auto& v : p.values) {
+                    if ((ok = tree.textEquals(n, v)))
+                        break;
+                }
+                break;
+            case MATCH:
+            {
+                pcre2_code* re = PcreCache::global().get(p.values[0], 0, p.patternHash);
+                std::string text = tree.getText(n);
+                ok = pcre2_match(re, (PCRE2_SPTR)text.data(), text.size(), 0, 0,
+                    predicateMatchData(), NULL) >= 0;
+                break;
+            }
+            }
+            ok = ok != p.negate;
+            if (p.any && ok)
+                return true;
+            if (!p.any && !ok)
+                return false;
+            seen = true;
+        }
+        // nothing captured holds trivially
+        return !p.any || !seen;
+    }
+
+    bool QueryPredicates::matches(const TSQueryMatch& match, CSTTree& tree) const {
+        if (match.pattern_index >= byPattern.size())
+            return true;
+        for (auto& p : byPattern[match.pattern_index]) {
+            if (!holds(p, match, tree))
+                return false;
+        }
+        return true;
+    }
+
     //CSTTree
 
     CSTTree::CSTTree(TSTree* tree, std::string_view source, TSEngine* parent)
@@ -10,19 +338,123 @@ namespace copypasta {
         DEBUG_FULL("CSTTree ctor");
     };
 
+    CSTTree::CSTTree(TSTree* tree, SharedText source, TSEngine* parent)
+        : source(source), owner(std::move(source)), parent(parent), tree(tree) {
+        DEBUG_FULL("CSTTree ctor shared source");
+    };
+
+    CSTTree::CSTTree(TSTree* tree, PieceTable source, TSEngine* parent)
+        : pieces(std::move(source)), fromPieces(true), parent(parent), tree(tree) {
+        DEBUG_FULL("CSTTree ctor piece source");
+    };
+
     CSTTree::CSTTree(const CSTTree& other)
         : source(other.source),
-        parent(other.parent) {
+        owner(other.owner),
+        pieces(other.pieces),
+        fromPieces(other.fromPieces),
+        parent(other.parent),
+        injected(other.injected),
+        origin(other.origin),
+        stale(other.stale),
+        deferEdits(other.deferEdits),
+        pendingEdits(other.pendingEdits),
+        changed(other.changed) {
         DEBUG_FULL("CSTTree copy ctor");
         tree = std::unique_ptr<TSTree, TSTreeDeleter>(ts_tree_copy(other.tree.get()));
     }
 
+    // source stays valid, a moved SharedText keeps the same bytes
+    CSTTree::CSTTree(CSTTree&& other) noexcept
+        : tree(std::move(other.tree)),
+        source(other.source),
+        owner(std::move(other.owner)),
+        pieces(std::move(other.pieces)),
+        fromPieces(other.fromPieces),
+        parent(other.parent),
+        injected(other.injected),
+        origin(other.origin),
+        stale(other.stale),
+        deferEdits(other.deferEdits),
+        pendingEdits(other.pendingEdits),
+        changed(std::move(other.changed)) {
+        DEBUG_FULL("CSTTree move ctor");
+        other.source = std::string_view();
+        other.fromPieces = false;
+        other.pendingEdits = 0;
+    }
+
+    CSTTree& CSTTree::operator=(const CSTTree& other) {
+        if (this == &other)
+            return *this;
+        DEBUG_FULL("CSTTree copy assign");
+        tree = std::unique_ptr<TSTree, TSTreeDeleter>(
+            other.tree ? ts_tree_copy(other.tree.get()) : nullptr);
+        source = other.source;
+        owner = other.owner;
+        pieces = other.pieces;
+        fromPieces = other.fromPieces;
+        parent = other.parent;
+        injected = other.injected;
+        origin = other.origin;
+        stale = other.stale;
+        deferEdits = other.deferEdits;
+        pendingEdits = other.pendingEdits;
+        changed = other.changed;
+        return *this;
+    }
+
+    CSTTree& CSTTree::operator=(CSTTree&& other) noexcept {
+        if (this == &other)
+            return *this;
+        DEBUG_FULL("CSTTree move assign");
+        tree = std::move(other.tree);
+        source = other.source;
+        owner = std::move(other.owner);
+        pieces = std::move(other.pieces);
+        fromPieces = other.fromPieces;
+        parent = other.parent;
+        injected = other.injected;
+        origin = other.origin;
+        stale = other.stale;
+        deferEdits = other.deferEdits;
+        pendingEdits = other.pendingEdits;
+        changed = std::move(other.changed);
+        other.source = std::string_view();
+        other.fromPieces = false;
+        other.pendingEdits = 0;
+        return *this;
+    }
+
+    void CSTTree::setSource(const PieceTable& text) {
+        pieces = text;
+        fromPieces = true;
+        owner = SharedText();
+        source = std::string_view();
+    }
+
+    void CSTTree::setSource(SharedText text) {
+        source = text;
+        owner = std::move(text);
+        pieces = PieceTable();
+        fromPieces = false;
+    }
+
+    std::string_view CSTTree::getSource() {
+        if (fromPieces && source.size() != pieces.size()) {
+            owner = pieces.flatten(); // cached by the table, shared with the writer
+            source = owner;
+        }
+        return source;
+    }
+
     CSTTree::~CSTTree() {
         DEBUG_FULL("CSTTree destroyed");
     };
 
     std::string CSTTree::asSexpr() {
         DEBUG_FULL("CSTTree asSexpr");
+        flush();
         TSNode node = ts_tree_root_node(tree.get());
         char* raw = ts_node_string(node);
         auto res = std::string(raw);
@@ -58,19 +490,71 @@ namespace copypasta {
         DEBUG_FULL("CSTTree getText");
         auto sb = ts_node_start_byte(n);
         auto eb = ts_node_end_byte(n);
+        if (fromPieces)
+            return pieces.substr(sb, eb - sb);
         return std::string(source.substr(sb, eb - sb));
     };
 
+    bool CSTTree::textEquals(TSNode n, std::string_view text) {
+        auto sb = ts_node_start_byte(n);
+        auto eb = ts_node_end_byte(n);
+        if (eb - sb != text.size())
+            return false;
+        if (!fromPieces)
+            return source.substr(sb, eb - sb) == text;
+        size_t at = 0;
+        bool same = true;
+        pieces.forEachChunk(sb, eb, [&](std::string_view chunk) {
+            same = text.substr(at, chunk.size()) == chunk;
+            at += chunk.size();
+            return same;
+            });
+        return same;
+    }
+
     std::string CSTTree::asQuery() {
         DEBUG_FULL("CSTTree asQuery");
+        flush();
         std::string query;
         TSNode node = ts_tree_root_node(tree.get());
         getQueryForNode(node, query);
         return query;
     };
 
+    std::vector<TSRange> CSTTree::captureRanges(TSQuery* query, const QueryPredicates& predicates,
+        const std::string& capture) {
+        uint32_t wanted = UINT32_MAX;
+        if (!capture.empty()) {
+            uint32_t count = ts_query_capture_count(query);
+            for (uint32_t i = 0; i < count && wanted == UINT32_MAX; i++) {
+                uint32_t len = 0;
+                const char* name = ts_query_capture_name_for_id(query, i, &len);
+                if (capture == std::string_view(name, len))
+                    wanted = i;
+            }
+            if (wanted == UINT32_MAX)
+                throw std::invalid_argument("CSTTree captureRanges no capture - " + capture);
+        }
+        std::vector<TSRange> ranges;
+        find(query, predicates, [&ranges, wanted](TSQueryMatch match) {
+            for (uint16_t i = 0; i < match.capture_count; i++) {
+                if (wanted == UINT32_MAX || match.captures[i].index == wanted)
+                    ranges.push_back(TSEngine::getRange(match.captures[i].node));
+            }
+            });
+        // a node captured by two patterns is one range
+        std::sort(ranges.begin(), ranges.end(), [](const TSRange& a, const TSRange& b) {
+            return a.start_byte != b.start_byte ? a.start_byte < b.start_byte : a.end_byte < b.end_byte;
+            });
+        ranges.erase(std::unique(ranges.begin(), ranges.end(), [](const TSRange& a, const TSRange& b) {
+            return a.start_byte == b.start_byte && a.end_byte == b.end_byte;
+            }), ranges.end());
+        DEBUG("CSTTree captureRanges - " << ranges.size());
+        return ranges;
+    }
+
     bool CSTTree::validate(const TSInputEdit ed, size_t insertL, size_t delL) {
-        size_t size = source.size();
+        size_t size = sourceSize();
 
         if (ed.start_byte > size)
             return false;
@@ -94,45 +578,387 @@ namespace copypasta {
     };
 
     void CSTTree::edit(const TSInputEdit ed, const std::string_view source) {
-        DEBUG("CSTTree edit");
+        edit(std::vector<TSInputEdit>{ ed }, source);
+    }
+
+    void CSTTree::edit(const TSInputEdit ed, SharedText source) {
+        edit(std::vector<TSInputEdit>{ ed }, std::move(source));
+    }
+
+    void CSTTree::edit(const TSInputEdit ed, const PieceTable& source) {
+        edit(std::vector<TSInputEdit>{ ed }, source);
+    }
+
+    void CSTTree::edit(const std::vector<TSInputEdit>& edits, SharedText source) {
+        edit(edits, std::string_view(source));
+        owner = std::move(source);
+    }
+
+    void CSTTree::edit(const std::vector<TSInputEdit>& edits, const std::string_view source) {
+        DEBUG("CSTTree edit batch - " << edits.size());
+        pieces = PieceTable();
+        fromPieces = false;
         this->source = source;
-        ts_tree_edit(tree.get(), &ed);
-        auto newTree = parent->parse(*this, source);
-        tree = std::move(newTree.tree);
-        newTree.tree = nullptr;
+        for (auto& ed : edits) {
+            ts_tree_edit(tree.get(), &ed);
+            recordEdit(ed);
+        }
+        pendingEdits += edits.size();
+        if (!deferEdits)
+            reparse();
+    }
+
+    void CSTTree::edit(const std::vector<TSInputEdit>& edits, const PieceTable& source) {
+        DEBUG("CSTTree edit batch from pieces - " << edits.size());
+        setSource(source);
+        for (auto& ed : edits) {
+            ts_tree_edit(tree.get(), &ed);
+            recordEdit(ed);
+        }
+        pendingEdits += edits.size();
+        if (!deferEdits)
+            reparse();
+    }
+
+    void CSTTree::recordEdit(const TSInputEdit& ed) {
+        for (auto& r : changed) {
+            shiftRange(r, ed);
+        }
+        changed.push_back({ ed.start_point, ed.new_end_point, ed.start_byte, ed.new_end_byte });
+    }
+
+    // one incremental parse for every edit since the last one, the old tree
+    // already carries their shifted ranges
+    // an aborted reparse keeps the edited old tree, its nodes are shifted but
+    // the edited text is not parsed, the next reparse picks the edits up again
+    void CSTTree::reparse() {
+        DEBUG("CSTTree reparse pending - " << pendingEdits);
+        std::unique_ptr<TSTree, TSTreeDeleter> next;
+        try {
+            auto newTree = fromPieces ? parent->parse(*this, pieces) : parent->parse(*this, source);
+            next = std::move(newTree.tree);
+        }
+        catch (const ParseAborted& e) {
+            WARN("CSTTree reparse aborted, tree is stale - " << e.what());
+            stale = true;
+            pendingEdits = 0;
+            mergeRanges(changed);
+            return;
+        }
+        stale = false;
+        if (tree && next) {
+            uint32_t count = 0;
+            TSRange* ranges = ts_tree_get_changed_ranges(tree.get(), next.get(), &count);
+            changed.insert(changed.end(), ranges, ranges + count);
+            free(ranges);
+        }
+        mergeRanges(changed);
+        tree = std::move(next);
+        pendingEdits = 0;
+    }
+
+    void CSTTree::setDeferred(bool on) {
+        deferEdits = on;
+        if (!on)
+            flush();
     }
 
     void CSTTree::sync() {
         DEBUG("CSTTree sync");
-        auto newTree = parent->parse(source);
-        tree = std::move(newTree.tree);
-        newTree.tree = nullptr;
+        try {
+            auto newTree = injected ? parent->parseIncluded(*this, includedRanges(tree.get()))
+                : fromPieces ? parent->parse(pieces, origin) : parent->parse(source, origin);
+            tree = std::move(newTree.tree);
+            stale = false;
+        }
+        catch (const ParseAborted& e) {
+            // the old tree stays, it no longer matches the text
+            WARN("CSTTree sync aborted, tree is stale - " << e.what());
+            stale = true;
+        }
+        pendingEdits = 0;
+        // not an incremental parse, everything counts as changed
+        changed.clear();
+        if (tree) {
+            TSNode root = ts_tree_root_node(tree.get());
+            changed.push_back(TSEngine::getRange(root));
+        }
     }
 
-    std::vector<TSRange> CSTTree::getErrors() {
-        std::string q = R"(
-      [
-         (ERROR)
-         (MISSING)
-      ] @syntax.error
-  )";
+    std::vector<TSRange> CSTTree::changedRanges() {
+        flush();
+        mergeRanges(changed);
+        return changed;
+    }
+
+    bool CSTTree::hasErrors() {
+        flush();
+        return tree && ts_node_has_error(ts_tree_root_node(tree.get()));
+    }
 
+    std::vector<TSRange> CSTTree::getErrors() {
         DEBUG("CSTTree getErrors start");
-        TSQuery* sq = TSQueryCache::global().get(parent, q);
         std::vector<TSRange> errors;
-        find(sq, [&errors](TSQueryMatch m) mutable {
-            for (size_t i = 0; i < m.capture_count; i++) {
-                TSNode n = m.captures[i].node;
-                TSRange r = { ts_node_start_point(n), ts_node_end_point(n),
-                             ts_node_start_byte(n), ts_node_end_byte(n) };
-                errors.push_back(r);
+        if (hasErrors()) {
+            TSNode root = ts_tree_root_node(tree.get());
+            collectErrors(root, 0, UINT32_MAX, errors, nullptr);
+        }
+        DEBUG("CSTTree getErrors ends - " << errors.size());
+        return errors;
+    }
+
+    std::vector<TSRange> CSTTree::getErrors(const std::vector<TSRange>& within) {
+        DEBUG("CSTTree getErrors in ranges - " << within.size());
+        std::vector<TSRange> errors;
+        if (!hasErrors())
+            return errors;
+        TSNode root = ts_tree_root_node(tree.get());
+        std::set<const void*> seen; // an error can span two ranges
+        for (auto& r : within) {
+            // a deletion leaves an empty range, the text around it still counts
+            uint32_t from = r.start_byte > 0 ? r.start_byte - 1 : 0;
+            uint32_t to = r.end_byte + 1;
+            collectErrors(root, from, to, errors, &seen);
+        }
+        DEBUG("CSTTree getErrors in ranges ends - " << errors.size());
+        return errors;
+    }
+
+    CSTTree::MatchList CSTTree::collectParallel(ThreadPool& pool, TSQuery* query,
+        const QueryPredicates& predicates) {
+        size_t workers = std::max(1u, std::thread::hardware_concurrency());
+        uint32_t target = std::max<uint32_t>(parallelChunkSize, (uint32_t)(sourceSize() / (workers * 4)));
+        const TSTree* original = tree.get();
+
+        auto job = std::make_shared<QueryJob>();
+        job->starts = splitPoints(ts_tree_root_node(original), target);
+        size_t chunks = job->starts.size();
+        job->matches.resize(chunks);
+        job->captures.resize(chunks);
+        job->keys.resize(chunks);
+
+        // claims chunks until none are left, the caller runs this on its own
+        // tree so the search finishes even when every pool worker is busy
+        auto work = [this, job, query, &predicates, chunks, original](const TSTree* handle) {
+            for (size_t k = job->next++; k < chunks; k = job->next++) {
+                uint32_t from = job->starts[k];
+                uint32_t to = k + 1 < chunks ? job->starts[k + 1] : UINT32_MAX;
+                auto& matches = job->matches[k];
+                auto& captures = job->captures[k];
+                try {
+                    QueryCursor cursor;
+                    ts_query_cursor_set_byte_range(cursor.get(), from, to);
+                    ts_query_cursor_exec(cursor.get(), query, ts_tree_root_node(handle));
+                    TSQueryMatch match;
+                    while (ts_query_cursor_next_match(cursor.get(), &match)) {
+                        // kept even when an earlier chunk has it, the merge orders by it
+                        if (!predicates.empty() && !predicates.matches(match, *this))
+                            continue;
+                        job->keys[k].push_back(matchKey(match));
+                        for (uint16_t i = 0; i < match.capture_count; i++) {
+                            TSQueryCapture cap = match.captures[i];
+                            // a copy shares every subtree, only the tree pointer differs
+                            cap.node.tree = original;
+                            captures.push_back(cap);
+                        }
+                        match.captures = nullptr;
+                        matches.push_back(match);
+                    }
+                }
+                catch (...) {
+                    std::lock_guard<std::mutex> lock(job->mtx);
+                    job->error = std::current_exception();
+                }
+                std::lock_guard<std::mutex> lock(job->mtx);
+                if (++job->done == chunks)
+                    job->finished.notify_all();
             }
-            });
+            };
 
-        DEBUG("CSTTree getErrors ends");
+        // a tree is not safe to read from two threads, each helper gets a copy
+        size_t helpers = std::min(chunks - 1, workers);
+        for (size_t i = 0; i < helpers; i++) {
+            TSTree* copy = ts_tree_copy(original);
+            pool.enqueue([work, copy]() {
+                work(copy);
+                ts_tree_delete(copy);
+                });
+        }
+        work(original);
+
+        {
+            std::unique_lock<std::mutex> lock(job->mtx);
+            job->finished.wait(lock, [&job, chunks] { return job->done == chunks; });
+        }
+
+        if (job->error)
+            std::rethrow_exception(job->error);
+
+        // find reports a match once the node completing it is reached, which can
+        // be past a split. A chunk's cursor reports every match whose pattern
+        // starts in a node touching its range, in the order find does. Matches an
+        // earlier chunk reported too are placed already and place the new ones:
+        // a new match goes before the next placed one of its chunk, or last,
+        // since matches only earlier chunks reported end before this chunk starts
+        struct Ref {
+            uint32_t chunk;
+            uint32_t index;
+        };
+        std::vector<std::vector<size_t>> capAt(chunks);
+        for (size_t k = 0; k < chunks; k++) {
+            size_t at = 0;
+            for (auto& match : job->matches[k]) {
+                capAt[k].push_back(at);
+                at += match.capture_count;
+            }
+        }
+        auto matchAt = [&job, &capAt](Ref ref) {
+            TSQueryMatch match = job->matches[ref.chunk][ref.index];
+            match.captures = job->captures[ref.chunk].data() + capAt[ref.chunk][ref.index];
+            return match;
+        };
+
+        std::list<Ref> order;
+        std::unordered_multimap<uint64_t, std::list<Ref>::iterator> placed;
+        for (uint32_t k = 0; k < chunks; k++) {
+            std::vector<Ref> pending;
+            std::vector<std::list<Ref>::iterator> fresh; // placed once the chunk is done
+            for (uint32_t i = 0; i < job->matches[k].size(); i++) {
+                TSQueryMatch match = matchAt({ k, i });
+                auto range = placed.equal_range(job->keys[k][i]);
+                auto seen = std::find_if(range.first, range.second,
+                    [&](const auto& p) { return sameMatch(matchAt(*p.second), match); });
+                if (seen == range.second) {
+                    pending.push_back({ k, i });
+                    continue;
+                }
+                for (auto& ref : pending)
+                    fresh.push_back(order.insert(seen->second, ref));
+                pending.clear();
+            }
+            for (auto& ref : pending)
+                fresh.push_back(order.insert(order.end(), ref));
+            for (auto it : fresh)
+                placed.emplace(job->keys[it->chunk][it->index], it);
+        }
+
+        MatchList found;
+        found.matches.reserve(order.size());
+        for (auto& ref : order) {
+            TSQueryMatch match = matchAt(ref);
+            found.captures.insert(found.captures.end(), match.captures, match.captures + match.capture_count);
+            found.matches.push_back(match);
+        }
+        size_t at = 0;
+        for (auto& match : found.matches) {
+            match.captures = found.captures.data() + at;
+            at += match.capture_count;
+        }
+        DEBUG("CSTTree collectParallel chunks - " << chunks << " matches - " << found.matches.size());
+        return found;
+    }
+
+    //InjectedLayer
+
+    bool InjectedLayer::hasErrors() {
+        for (auto& t : trees) {
+            if (t.hasErrors())
+                return true;
+        }
+        return false;
+    }
+
+    std::vector<TSRange> InjectedLayer::getErrors() {
+        std::vector<TSRange> errors;
+        for (auto& t : trees) {
+            auto found = t.getErrors();
+            errors.insert(errors.end(), found.begin(), found.end());
+        }
         return errors;
     }
 
+    //ParseControl
+
+    namespace {
+        // abort signal of the walk job running on this thread
+        thread_local const std::atomic<bool>* scopeSignal = nullptr;
+    }
+
+    ParseControl::Scope::Scope(const std::atomic<bool>* signal) : previous(scopeSignal) {
+        scopeSignal = signal;
+    }
+
+    ParseControl::Scope::~Scope() {
+        scopeSignal = previous;
+    }
+
+    bool ParseControl::isCancelled() const {
+        return cancelled.load(std::memory_order_relaxed)
+            || (scopeSignal != nullptr && scopeSignal->load(std::memory_order_relaxed));
+    }
+
+    void ParseControl::recordAborted(const std::string& what, bool timedOut) {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (timedOut)
+            aborted.timedOut++;
+        else
+            aborted.cancelled++;
+        aborted.files.push_back(what);
+    }
+
+    ParseStats ParseControl::stats() const {
+        std::lock_guard<std::mutex> lock(mtx);
+        return aborted;
+    }
+
+    void ParseControl::reset() {
+        std::lock_guard<std::mutex> lock(mtx);
+        aborted = ParseStats();
+        cancelled = false;
+    }
+
+    namespace {
+        struct ParseBudget {
+            bool limited = false;
+            std::chrono::steady_clock::time_point deadline;
+            bool timedOut = false;
+            bool cancelled = false;
+        };
+
+        // tree-sitter calls this every few hundred steps, true stops the parse
+        bool parseProgress(TSParseState* state) {
+            auto budget = static_cast<ParseBudget*>(state->payload);
+            if (ParseControl::global().isCancelled()) {
+                budget->cancelled = true;
+                return true;
+            }
+            if (budget->limited && std::chrono::steady_clock::now() > budget->deadline) {
+                budget->timedOut = true;
+                return true;
+            }
+            return false;
+        }
+
+        const char* stringRead(void* payload, uint32_t byte_index, TSPoint point,
+            uint32_t* bytes_read) {
+            auto text = static_cast<const std::string_view*>(payload);
+            if (byte_index >= text->size()) {
+                *bytes_read = 0;
+                return "";
+            }
+            *bytes_read = (uint32_t)(text->size() - byte_index);
+            return text->data() + byte_index;
+        }
+
+        // text must outlive the parse
+        TSInput stringInput(const std::string_view* text) {
+            TSInput input{};
+            input.payload = const_cast<std::string_view*>(text);
+            input.read = &stringRead;
+            input.encoding = TSInputEncodingUTF8;
+            return input;
+        }
+    }
 
     //TSEngine
 
@@ -156,41 +982,157 @@ namespace copypasta {
     };
 
 
+    TSTree* TSEngine::parseInput(const TSTree* old, TSInput input, const std::string& what) {
+        auto& control = ParseControl::global();
+        const std::string label = what.empty() ? "<text>" : what;
+        ParseBudget budget;
+        if (control.isCancelled()) {
+            control.recordAborted(label, false);
+            throw ParseAborted("TSEngine parse cancelled - " + label, false);
+        }
+        if (uint64_t micros = control.budget()) {
+            budget.limited = true;
+            budget.deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(micros);
+        }
+        TSParseOptions options{ &budget, &parseProgress };
+        TSTree* tree = ts_parser_parse_with_options(parser, old, input, options);
+        if (tree != nullptr || !(budget.timedOut || budget.cancelled))
+            return tree;
+
+        // a stopped parse resumes on the next call unless the parser is reset
+        ts_parser_reset(parser);
+        control.recordAborted(label, budget.timedOut);
+        WARN("TSEngine parse " << (budget.timedOut ? "timed out" : "cancelled") << " - " << label);
+        throw ParseAborted(std::string("TSEngine parse ") + (budget.timedOut ? "timed out" : "cancelled")
+            + " - " + label, budget.timedOut);
+    }
+
+    TSTree* TSEngine::parseWithin(const TSTree* old, TSInput input, const std::vector<TSRange>& ranges,
+        const std::string& what) {
+        // no ranges would mean the whole document
+        if (ranges.empty())
+            throw std::invalid_argument("TSEngine parse within no ranges");
+        if (!ts_parser_set_included_ranges(parser, ranges.data(), (uint32_t)ranges.size()))
+            throw std::invalid_argument("TSEngine included ranges unsorted or overlapping - "
+                + std::to_string(ranges.size()));
+        try {
+            TSTree* tree = parseInput(old, input, what.empty() ? "<included>" : what + " <included>");
+            ts_parser_set_included_ranges(parser, NULL, 0);
+            return tree;
+        }
+        catch (...) {
+            ts_parser_set_included_ranges(parser, NULL, 0);
+            throw;
+        }
+    }
+
     CSTTree TSEngine::parse(FileReader& reader) {
         DEBUG_FULL("TSEngine parse begin");
-        TSTree* tree = ts_parser_parse(parser, NULL, reader.asTsInput());
+        TSTree* tree = parseInput(NULL, reader.asTsInput(), reader.getFile().pathStr);
         DEBUG_FULL("TSEngine parse end");
-        return CSTTree(tree, reader.get(reader.bufStart, reader.bufSize), this);
+        // buf is absolute from 0 and the parser read it to the end
+        CSTTree res(tree, reader.shared(), this);
+        res.origin = reader.getFile().pathStr;
+        return res;
     }
 
     CSTTree TSEngine::parse(FileWriter& writer) {
-        auto source = writer.snapshot().cont;
-        // TODO: use TSInput here
         DEBUG_FULL("TSEngine parse begin");
-        TSTree* tree =
-            ts_parser_parse_string(parser, NULL, source.data(), source.length());
+        PieceTable text = writer.content();
+        TSTree* tree = parseInput(NULL, text.asTsInput(), writer.getFile().pathStr);
         DEBUG_FULL("TSEngine parse end");
-        return CSTTree(tree, source, this);
+        CSTTree res(tree, std::move(text), this);
+        res.origin = writer.getFile().pathStr;
+        return res;
     }
 
-    CSTTree TSEngine::parse(std::string_view source) {
-        // TODO: use TSInput here
+    CSTTree TSEngine::parse(const PieceTable& source, const std::string& what) {
         DEBUG_FULL("TSEngine parse begin");
-        TSTree* tree =
-            ts_parser_parse_string(parser, NULL, source.data(), source.length());
+        // the table is only copied, its nodes and buffers are shared
+        PieceTable text = source;
+        TSTree* tree = parseInput(NULL, text.asTsInput(), what);
         DEBUG_FULL("TSEngine parse end");
-        return CSTTree(tree, source, this);
+        CSTTree res(tree, std::move(text), this);
+        res.origin = what;
+        return res;
+    }
+
+    CSTTree TSEngine::parse(std::string_view source, const std::string& what) {
+        DEBUG_FULL("TSEngine parse begin");
+        TSTree* tree = parseInput(NULL, stringInput(&source), what);
+        DEBUG_FULL("TSEngine parse end");
+        CSTTree res(tree, source, this);
+        res.origin = what;
+        return res;
+    };
+
+    CSTTree TSEngine::parse(SharedText source) {
+        DEBUG_FULL("TSEngine parse begin");
+        std::string_view text = source;
+        TSTree* tree = parseInput(NULL, stringInput(&text), "");
+        DEBUG_FULL("TSEngine parse end");
+        return CSTTree(tree, std::move(source), this);
     };
 
     CSTTree TSEngine::parse(const CSTTree& old, std::string_view source) {
-        // TODO: use TSInput here
         DEBUG("TSEngine parse begin");
-        TSTree* tree =
-            ts_parser_parse_string(parser, old.tree.get(), source.data(), source.length());
+        TSInput input = stringInput(&source);
+        TSTree* tree = old.injected ? parseWithin(old.tree.get(), input, includedRanges(old.tree.get()), old.origin)
+            : parseInput(old.tree.get(), input, old.origin);
         DEBUG("TSEngine parse end");
         return CSTTree(tree, source, this);
     };
 
+    // the caller keeps source alive, CSTTree::edit passes its own pieces
+    CSTTree TSEngine::parse(const CSTTree& old, const PieceTable& source) {
+        DEBUG("TSEngine parse from pieces begin");
+        TSTree* tree = old.injected ? parseWithin(old.tree.get(), source.asTsInput(), includedRanges(old.tree.get()), old.origin)
+            : parseInput(old.tree.get(), source.asTsInput(), old.origin);
+        DEBUG("TSEngine parse end");
+        return CSTTree(tree, std::string_view(), this);
+    };
+
+    CSTTree TSEngine::parseIncluded(const CSTTree& host, const std::vector<TSRange>& ranges) {
+        DEBUG("TSEngine parse included begin - " << ranges.size());
+        // same text as the host, nothing is copied
+        CSTTree res(nullptr, host.source, this);
+        res.owner = host.owner;
+        res.pieces = host.pieces;
+        res.fromPieces = host.fromPieces;
+        res.injected = true;
+        res.origin = host.origin;
+        TSInput input = res.fromPieces ? res.pieces.asTsInput() : stringInput(&res.source);
+        res.tree.reset(parseWithin(NULL, input, ranges, host.origin));
+        DEBUG("TSEngine parse included end");
+        return res;
+    }
+
+    InjectedLayer TSEngine::inject(const CSTTree& host, std::vector<TSRange> ranges, bool combined) {
+        DEBUG("TSEngine inject - " << ranges.size() << (combined ? " combined" : ""));
+        std::sort(ranges.begin(), ranges.end(), [](const TSRange& a, const TSRange& b) {
+            return a.start_byte < b.start_byte;
+            });
+        std::vector<CSTTree> trees;
+        if (combined) {
+            // included ranges can not overlap, a nested range is already inside the outer one
+            std::vector<TSRange> disjoint;
+            for (auto& r : ranges) {
+                if (r.end_byte > r.start_byte && (disjoint.empty() || r.start_byte >= disjoint.back().end_byte))
+                    disjoint.push_back(r);
+            }
+            if (!disjoint.empty())
+                trees.push_back(parseIncluded(host, disjoint));
+        }
+        else {
+            trees.reserve(ranges.size());
+            for (auto& r : ranges) {
+                if (r.end_byte > r.start_byte)
+                    trees.push_back(parseIncluded(host, { r }));
+            }
+        }
+        return InjectedLayer(std::move(trees), this);
+    }
+
     TSQuery* TSEngine::queryNew(std::string& queryExpr) const {
         DEBUG("TSEngine queryNew " << queryExpr);
         uint32_t errorOffset = 0;
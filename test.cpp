@@ -158,6 +158,23 @@ void benchmarkDirWalker()
             return DirWalker::CONTINUE;
         });
     });
+
+    // readers only touch the content on first access
+    size_t readers = 0;
+    std::chrono::nanoseconds ctorTime{0};
+    walker.walk([&](DirWalker::STATUS status, File file, void*) {
+        if (status != DirWalker::OPENED || !file.isReg)
+            return DirWalker::CONTINUE;
+        auto start = Clock::now();
+        FileReader reader(std::move(file));
+        ctorTime += Clock::now() - start;
+        readers++;
+        return DirWalker::CONTINUE;
+    });
+
+    std::cout << "FileReader ctor -> "
+              << (readers ? ctorTime.count() / readers : 0)
+              << " ns/file over " << readers << " files\n";
 }
 
 // =====================================================
@@ -185,6 +202,19 @@ void stressTest10GB()
         std::cout << "Streamed MB: "
                   << total / (1024 * 1024) << "\n";
     });
+
+    measure("Sequential find 10GB", [&]() {
+        std::cout << "Matches: " << reader.count("AAB", false)
+                  << " | " << reader.count("A{3}B", true) << "\n";
+    });
+
+    ThreadPool pool(std::thread::hardware_concurrency());
+    FileReader::MatchBuffer out;
+
+    measure("Parallel find 10GB", [&]() {
+        std::cout << "Matches: " << reader.findInto(pool, out, "AAB", false)
+                  << " | " << reader.findInto(pool, out, "A{3}B", true) << "\n";
+    });
 }
 
 // =====================================================
@@ -237,6 +267,123 @@ void benchmarkPipelineSingle()
               << " MB/s\n";
 }
 
+// =====================================================
+// Buffer Copies (reader -> writer -> containers)
+// =====================================================
+
+void benchmarkBufferCopies()
+{
+    std::cout << "\n==== Buffer Copies Per File ====\n";
+
+    std::string root = TEMP_DIR + "/buffer_copies";
+
+    generateDirectoryTree(root, 2, 3, 10, 256 * 1024);
+
+    size_t totalFiles = 0;
+    std::vector<FileReader> readers;
+    std::vector<FileWriter> writers;
+
+    size_t before = SharedText::copies().load();
+
+    DirWalker walker(root);
+
+    walker.walk([&](DirWalker::STATUS status, File file, void*) {
+
+        if (status != DirWalker::OPENED || !file.isReg)
+            return DirWalker::CONTINUE;
+
+        totalFiles++;
+
+        // the same hand offs the Lua read/write bindings do
+        FileReader reader = FileReader(file.pathStr);
+        FileWriter writer = FileWriter(reader.snapshot());
+        writer.insert(0, "header\n");
+        FileWriter copy = writer;
+        copy.append("footer\n");
+
+        readers.push_back(std::move(reader));
+        writers.push_back(std::move(writer));
+        writers.push_back(std::move(copy));
+
+        return DirWalker::CONTINUE;
+    });
+
+    size_t copies = SharedText::copies().load() - before;
+
+    std::cout << "Files: " << totalFiles
+              << " | Buffer copies: " << copies
+              << " | Per file: "
+              << (totalFiles ? (double)copies / totalFiles : 0.0)
+              << "\n";
+}
+
+// =====================================================
+// Editor apply vs edit count (deferred reparse)
+// =====================================================
+
+void benchmarkEditorDeferred()
+{
+    std::cout << "\n==== Editor Apply vs Edit Count ====\n";
+
+    TSLoader loader;
+    TSLangWrapper lang = loader.get("java");
+    if (!lang.isValid()) {
+        std::cout << "java parser not found, skipping\n";
+        return;
+    }
+    TSEngine eng(lang.getLang()->getRaw());
+
+    std::string src = "class A {\n";
+    for (size_t i = 0; i < 2000; ++i)
+        src += "  int f" + std::to_string(i) + "() { return " + std::to_string(i) + "; }\n";
+    src += "}\n";
+    std::string path = TEMP_DIR + "/editor_deferred.java";
+    {
+        std::ofstream out(path, std::ios::binary);
+        out << src;
+    }
+
+    // row inserts go through step(), one tree edit each
+    auto queueRows = [](FileEditor& ed, size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            TSRange r{};
+            r.start_point = { (uint32_t)(1 + i * 2000 / count), 0 };
+            r.end_point = r.start_point;
+            ed.queue({ FileEditor::OP_INSERT_ROW_BEFORE, r, "  // note " + std::to_string(i) });
+        }
+        ed.sortOperations();
+    };
+
+    for (size_t count : { 10, 100, 1000 }) {
+        long long immediate = 0;
+        {
+            FileReader reader(path);
+            FileWriter writer(reader.snapshot());
+            CSTTree tree = eng.parse(writer);
+            FileEditor ed;
+            queueRows(ed, count);
+            immediate = measure("reparse per edit   x" + std::to_string(count), [&]() {
+                for (size_t i = 0; i < count; ++i)
+                    ed.step(tree, writer);
+            });
+        }
+        long long deferred = 0;
+        {
+            FileReader reader(path);
+            FileWriter writer(reader.snapshot());
+            CSTTree tree = eng.parse(writer);
+            FileEditor ed;
+            queueRows(ed, count);
+            deferred = measure("deferred apply     x" + std::to_string(count), [&]() {
+                ed.apply(tree, writer);
+            });
+        }
+        std::cout << "Edits: " << count
+                  << " | Per edit: " << (double)immediate / count << " ms"
+                  << " vs " << (double)deferred / count << " ms\n";
+    }
+}
+
 // =====================================================
 // Composed Pipeline (Multi Thread)
 // =====================================================
@@ -315,6 +462,89 @@ void stressDistributedDir()
     benchmarkPipelineMulti();
 }
 
+// =====================================================
+// Query sequential vs parallel on one large tree
+// =====================================================
+
+void benchmarkQueryParallel()
+{
+    std::cout << "\n==== Query Sequential vs Parallel ====\n";
+
+    TSLoader loader;
+    TSLangWrapper lang = loader.get("java");
+    if (!lang.isValid()) {
+        std::cout << "java parser not found, skipping\n";
+        return;
+    }
+    TSEngine eng(lang.getLang()->getRaw());
+
+    // one generated entity class, the shape that keeps a single find on one core,
+    // with the native query and cast shapes staticCastHandling.lua rewrites
+    std::string src = "class Entity {\n";
+    for (size_t i = 0; i < 200000; ++i) {
+        src += "  private int f" + std::to_string(i) + " = " + std::to_string(i) + ";\n";
+        if (i % 100 == 0) {
+            src += "  Object[] q" + std::to_string(i) + "() { return em.createNativeQuery(\"select \" + "
+                 + std::to_string(i) + ", Object[].class); }\n";
+            src += "  Long c" + std::to_string(i) + "(Object[] row) { return (Long) row[" + std::to_string(i % 7) + "]; }\n";
+        }
+    }
+    src += "}\n";
+    CSTTree tree = eng.parse(SharedText(std::move(src)));
+
+    std::string expr = "(field_declaration declarator: (variable_declarator name: (identifier) @name "
+                       "(#match? @name \"^f[0-9]*7$\")))";
+    auto& compiled = TSQueryCache::global().entry(&eng, expr);
+    ThreadPool pool(std::thread::hardware_concurrency());
+
+    std::vector<uint32_t> sequential;
+    std::vector<uint32_t> parallel;
+    measure("find sequential", [&]() {
+        tree.find(compiled.query, compiled.predicates, [&](TSQueryMatch match) {
+            sequential.push_back(ts_node_start_byte(match.captures[0].node));
+        });
+    });
+    measure("find parallel", [&]() {
+        tree.findParallel(pool, compiled.query, compiled.predicates, [&](TSQueryMatch match) {
+            parallel.push_back(ts_node_start_byte(match.captures[0].node));
+        });
+    });
+    std::cout << "Matches: " << sequential.size() << " vs " << parallel.size()
+              << " | Same order: " << (sequential == parallel ? "yes" : "NO") << "\n";
+
+    // matches completing past a split: several captures, uncaptured trailing
+    // nodes, siblings and the class around everything, in one query
+    std::vector<std::string> orderQueries = {
+        "(method_invocation (identifier) @method_name (#eq? @method_name \"createNativeQuery\")\n"
+        "  arguments: (argument_list [(string_literal) (binary_expression)] @first_arg (class_literal) @second_arg "
+        "(#eq? @second_arg \"Object[].class\")))\n"
+        "(cast_expression type: (type_identifier) @cast_type value: (array_access) @cast_value) @cast",
+        "(class_declaration name: (identifier) @class_name) @class\n"
+        "(field_declaration declarator: (variable_declarator name: (identifier) @field)) @decl\n"
+        "(variable_declarator name: (identifier) @name value: (decimal_integer_literal))\n"
+        "((field_declaration) @first . (field_declaration) @second)\n"
+        "((method_declaration name: (identifier) @method) . (field_declaration))",
+    };
+    for (auto& text : orderQueries) {
+        auto& entry = TSQueryCache::global().entry(&eng, text);
+        // pattern, then capture index and start of every capture, match by match
+        auto record = [](std::vector<uint32_t>& into) {
+            return [&into](TSQueryMatch match) {
+                into.push_back(match.pattern_index);
+                for (uint16_t i = 0; i < match.capture_count; i++) {
+                    into.push_back(match.captures[i].index);
+                    into.push_back(ts_node_start_byte(match.captures[i].node));
+                }
+            };
+        };
+        std::vector<uint32_t> expected;
+        std::vector<uint32_t> got;
+        tree.find(entry.query, entry.predicates, record(expected));
+        tree.findParallel(pool, entry.query, entry.predicates, record(got));
+        std::cout << "Mixed query order: " << (expected == got ? "same" : "DIFFERENT") << "\n";
+    }
+}
+
 // =====================================================
 // MAIN
 // =====================================================
@@ -325,7 +555,8 @@ int main(int argc, char** argv)
 
     if (argc < 2) {
         std::cout << "Usage: ./perf [all|small|threadpool|dir|10gb|"
-                     "pipeline-single|pipeline-multi|pipeline-all|stress-dir]\n";
+                     "pipeline-single|pipeline-multi|pipeline-all|stress-dir|copies|editor|"
+                     "query-parallel]\n";
         return 0;
     }
 
@@ -351,6 +582,9 @@ int main(int argc, char** argv)
             benchmarkPipelineMulti();
         }
         else if (mode == "stress-dir") stressDistributedDir();
+        else if (mode == "copies") benchmarkBufferCopies();
+        else if (mode == "editor") benchmarkEditorDeferred();
+        else if (mode == "query-parallel") benchmarkQueryParallel();
         else {
             std::cout << "Unknown mode.\n";
         }